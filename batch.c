@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+
+// Expressions read past the oldest one not yet printed.
+#define WINDOW 256
+
+#define READ_SIZE 65536
+
+typedef struct {
+  Chunk chunk;
+  Obj* objects;   // the chunk's constants
+  Job* job;       // NULL if it didn't compile
+  char* error;    // why it didn't
+  bool done;
+} Expression;
+
+static void collectJobs(void);
+static const char* nextExpression(char delimiter, bool ended);
+static void printExpression(const BatchOptions* options, uint64_t n);
+static bool readInput(void);
+static void startExpression(const BatchOptions* options, const char* source);
+
+// Expression n is at n % WINDOW.
+static Expression expressions[WINDOW];
+static uint64_t started = 0;
+static uint64_t printed = 0;
+static int status = 0;
+
+// Bytes before inputStart have been compiled.
+static char* input = NULL;
+static size_t inputStart = 0;
+static size_t inputCount = 0;
+static size_t inputCapacity = 0;
+
+// Where the compiler says what's wrong.
+static FILE* errors;
+static char* errorBytes;
+static size_t errorSize;
+
+static void collectJobs() {
+  for (Job* job = finishedJobs(); job != NULL; job = job->next) {
+    ((Expression*)job->owner)->done = true;
+  }
+}
+
+// The compiler and the pool are started once; each expression only
+// needs a chunk. Output is flushed only when there's nothing to do but
+// wait for input or for workers.
+int evaluateBatch(const BatchOptions* options) {
+  errors = open_memstream(&errorBytes, &errorSize);
+  if (errors == NULL) {
+    fprintf(stderr, "Not enough memory to buffer errors.\n");
+    return 74;
+  }
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+  startPool(options->workers, options->poolSampling);
+
+  bool ended = false;
+  for (;;) {
+    const char* source;
+    while (started - printed < WINDOW && (source = nextExpression(options->delimiter, ended)) != NULL) {
+      startExpression(options, source);
+    }
+    while (printed < started && expressions[printed % WINDOW].done) {
+      printExpression(options, printed++);
+    }
+    if (ended && inputStart == inputCount && printed == started) { break; }
+
+    bool reading = !ended && started - printed < WINDOW;
+    struct pollfd fds[2] = { { poolSignal(), POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+    if (poll(fds, reading ? 2 : 1, 0) == 0) {
+      fflush(stdout);
+      if (poll(fds, reading ? 2 : 1, -1) < 0) { continue; }
+    }
+    if (fds[0].revents & POLLIN) {
+      collectJobs();
+    }
+    if (reading && fds[1].revents != 0) {
+      ended = !readInput();
+    }
+  }
+
+  fflush(stdout);
+  return status;
+}
+
+// Cuts the next expression off the input, terminated in place, or NULL
+// if there isn't a whole one yet. The last needn't have a delimiter.
+static const char* nextExpression(char delimiter, bool ended) {
+  if (inputStart == inputCount) { return NULL; }
+
+  char* source = input + inputStart;
+  char* end = (char*)memchr(source, delimiter, inputCount - inputStart);
+  if (end == NULL) {
+    if (!ended) { return NULL; }
+    if (inputCount == inputCapacity) {
+      input = GROW_ARRAY(char, input, inputCapacity, inputCapacity + 1);
+      inputCapacity++;
+      source = input + inputStart;
+    }
+    end = input + inputCount;
+    inputCount++;
+  }
+  *end = '\0';
+  inputStart = (size_t)(end + 1 - input);
+  return source;
+}
+
+// An expression's record, or if it failed, why on standard error.
+static void printExpression(const BatchOptions* options, uint64_t n) {
+  Expression* expression = &expressions[n % WINDOW];
+  Job* job = expression->job;
+  const char* error = job == NULL ? expression->error : job->error;
+  if (error != NULL) {
+    fprintf(stderr, "Expression %llu: %s", (unsigned long long)(n + 1), error);
+    if (status == 0) {
+      status = job == NULL ? 65 : 70;
+    }
+  } else if (job->sink == SINK_OUTPUT) {
+    fwrite(job->text, 1, job->textSize, stdout);
+  } else {
+    printTotals(stdout, &job->totals, job->sink, 0);
+  }
+  fputc(options->delimiter, stdout);
+
+  if (job != NULL) {
+    freeJob(job);
+    freeChunk(&expression->chunk);
+    freeObjectList(expression->objects);
+  }
+  free(expression->error);
+}
+
+// False at the end of the input, or if it can't be read.
+static bool readInput() {
+  if (inputStart > 0) {
+    memmove(input, input + inputStart, inputCount - inputStart);
+    inputCount -= inputStart;
+    inputStart = 0;
+  }
+  if (inputCapacity - inputCount < READ_SIZE) {
+    size_t capacity = GROW_CAPACITY(inputCapacity);
+    while (capacity - inputCount < READ_SIZE) {
+      capacity *= 2;
+    }
+    input = GROW_ARRAY(char, input, inputCapacity, capacity);
+    inputCapacity = capacity;
+  }
+
+  ssize_t n = read(STDIN_FILENO, input + inputCount, inputCapacity - inputCount);
+  if (n > 0) {
+    inputCount += (size_t)n;
+    return true;
+  }
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) { return true; }
+  if (n < 0) {
+    fprintf(stderr, "Could not read standard input.\n");
+    if (status == 0) {
+      status = 74;
+    }
+  }
+  return false;
+}
+
+static void startExpression(const BatchOptions* options, const char* source) {
+  Expression* expression = &expressions[started % WINDOW];
+  expression->job = NULL;
+  expression->error = NULL;
+  expression->done = false;
+
+  rewind(errors);
+  initChunk(&expression->chunk);
+  Obj* mark = objectMark();
+  if (!compile(source, &expression->chunk, errors)) {
+    freeChunk(&expression->chunk);
+    freeObjectsSince(mark);
+    fflush(errors);
+    size_t size = (size_t)ftell(errors);
+    expression->error = ALLOCATE(char, size + 1);
+    memcpy(expression->error, errorBytes, size);
+    expression->error[size] = '\0';
+    expression->done = true;
+    started++;
+    return;
+  }
+
+  expression->objects = takeObjectsSince(mark);
+  expression->job = newJob(&expression->chunk, options->sink, options->samples, options->seed,
+                           options->stream + started, expression);
+  expression->job->first = options->first;
+  submitJob(expression->job);
+  started++;
+}
@@ -0,0 +1,36 @@
+#ifndef tvm_batch_h
+#define tvm_batch_h
+
+#include "totals.h"
+#include "vm.h"
+
+// tvm --batch: evaluates every expression on standard input, one per
+// line, or with --null, each ended by a NUL. Each expression is compiled
+// as soon as it's read and run on the pool's workers (see pool.h) while
+// the ones after it are read. What tvm would print for it goes to
+// standard output, in the order of the input, followed by an empty line
+// (or a NUL), so the nth record is always the nth expression's; since
+// an empty collection prints as an empty line, only NULs keep records
+// apart whatever the results. One that fails leaves its record empty and
+// says why on standard error.
+//
+// Expression i, counting from 0, uses stream + i, so no two expressions
+// share random numbers.
+
+typedef struct {
+  char delimiter;
+  Sink sink;
+  uint64_t first;
+  uint64_t samples;
+  uint64_t seed;
+  uint64_t stream;
+  int workers;
+  PoolSampling poolSampling;
+} BatchOptions;
+
+// The exit code of the first expression that failed (65 if it didn't
+// compile, 70 if it didn't run), 74 if standard input couldn't be read,
+// or 0.
+int evaluateBatch(const BatchOptions* options);
+
+#endif
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+
+static bool cacheDirectory(char* path, size_t size);
+static void hashBlock(uint32_t state[8], const uint8_t* block);
+static bool makeDirectory(const char* path);
+static char* readSource(const char* path, size_t* length);
+
+// Creates the directory if it isn't there yet.
+static bool cacheDirectory(char* path, size_t size) {
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  int n;
+  if (xdg != NULL && xdg[0] == '/') {
+    n = snprintf(path, size, "%s", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    n = snprintf(path, size, "%s/.cache", home);
+  } else {
+    return false;
+  }
+  if (n < 0 || (size_t)n + sizeof("/troll") > size || !makeDirectory(path)) {
+    return false;
+  }
+  strcat(path, "/troll");
+  return makeDirectory(path);
+}
+
+Chunk* compileCached(const char* path) {
+  size_t length;
+  char* source = readSource(path, &length);
+
+  uint64_t hash[2];
+  hashSource(source, length, hash);
+  char cached[4096];
+  bool caching = cacheDirectory(cached, sizeof(cached) - 64);
+  if (caching) {
+    size_t n = strlen(cached);
+    snprintf(cached + n, sizeof(cached) - n, "/%016" PRIx64 "%016" PRIx64 "-%d.g", hash[0], hash[1],
+             COMPILER_VERSION);
+  }
+
+  Chunk* chunk = caching ? loadCachedChunk(cached) : NULL;
+  if (chunk == NULL) {
+    chunk = ALLOCATE(Chunk, 1);
+    initChunk(chunk);
+    if (!compile(source, chunk, stderr)) {
+      exit(65);
+    }
+    if (caching) {
+      cacheChunk(chunk, cached);
+    }
+  }
+
+  free(source);
+  return chunk;
+}
+
+// One round of SHA-256's compression function over a 64-byte block.
+static void hashBlock(uint32_t state[8], const uint8_t* block) {
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+  };
+#define ROTATE(x, n) ((x) >> (n) | (x) << (32 - (n)))
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTATE(w[i - 15], 7) ^ ROTATE(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTATE(w[i - 2], 17) ^ ROTATE(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t v[8];
+  memcpy(v, state, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = ROTATE(v[4], 6) ^ ROTATE(v[4], 11) ^ ROTATE(v[4], 25);
+    uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    uint32_t t1 = v[7] + s1 + choice + k[i] + w[i];
+    uint32_t s0 = ROTATE(v[0], 2) ^ ROTATE(v[0], 13) ^ ROTATE(v[0], 22);
+    uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + s0 + majority;
+  }
+#undef ROTATE
+  for (int i = 0; i < 8; i++) {
+    state[i] += v[i];
+  }
+}
+
+// The first 128 bits of the source's SHA-256, so that nobody can write a
+// source that gets another source's chunk.
+void hashSource(const char* source, size_t length, uint64_t hash[2]) {
+  uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  size_t whole = length - length % 64;
+  for (size_t i = 0; i < whole; i += 64) {
+    hashBlock(state, (const uint8_t*)source + i);
+  }
+
+  // The rest of the source, a 1 bit, zeros, and the length in bits.
+  uint8_t tail[128] = { 0 };
+  size_t rest = length - whole;
+  memcpy(tail, source + whole, rest);
+  tail[rest] = 0x80;
+  size_t tailLength = rest < 56 ? 64 : 128;
+  uint64_t bits = (uint64_t)length * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tailLength - 1 - i] = (uint8_t)(bits >> (8 * i));
+  }
+  for (size_t i = 0; i < tailLength; i += 64) {
+    hashBlock(state, tail + i);
+  }
+
+  hash[0] = (uint64_t)state[0] << 32 | state[1];
+  hash[1] = (uint64_t)state[2] << 32 | state[3];
+}
+
+static bool makeDirectory(const char* path) {
+  return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static char* readSource(const char* path, size_t* length) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file '%s'.\n", path);
+    exit(74);
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(fileSize + 1);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read '%s'.\n", path);
+    exit(74);
+  }
+
+  *length = fread(buffer, sizeof(char), fileSize, file);
+  if (*length < fileSize) {
+    fprintf(stderr, "Could not read file '%s'.\n", path);
+    exit(74);
+  }
+  buffer[*length] = '\0';
+
+  fclose(file);
+  return buffer;
+}
@@ -0,0 +1,20 @@
+#ifndef tvm_cache_h
+#define tvm_cache_h
+
+#include "chunk.h"
+
+// Chunks compiled from source files are kept in $XDG_CACHE_HOME/troll
+// (or ~/.cache/troll), named by a hash of the source and the
+// COMPILER_VERSION that compiled it, so that running the same source
+// again skips the compiler but a tvm that compiles it differently
+// doesn't run an older one's code.
+
+// The chunk for a source file, compiled only if the cache doesn't have
+// it. Exits if the source can't be read or doesn't compile.
+Chunk* compileCached(const char* path);
+
+// The 128-bit hash chunks are cached under, here and in tvm --serve:
+// the first 16 bytes of the source's SHA-256.
+void hashSource(const char* source, size_t length, uint64_t hash[2]);
+
+#endif
@@ -1,137 +1,1144 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "chunk.h"
 #include "memory.h"
 #include "object.h"
+#include "table.h"
 
+// Chunk files
+//
+// A chunk file is a header, a table of sections and the sections. Numbers
+// are little-endian whatever the machine, and every section starts on an
+// 8 byte boundary so that it can be used straight from a mapping.
+//
+//   header     "TVMC", u16 version, u16 0xfeff (byte order), u32 CRC-32
+//              of everything after it, u32 number of sections
+//   table      for each section: u32 kind, u32 offset, u32 size, u32 count
+//   code       count bytes of bytecode
+//   lines      count runs of instructions on the same line, each a varint
+//              number of bytes and the zigzag varint change in line
+//   stack      u32, the most values the code ever has on the stack
+//   constants  count constants, each a tag byte and then a zigzag varint
+//              (integer), an IEEE double (real) or the varint offset of a
+//              string in the pool
+//   strings    count strings, each a varint length and the characters
+//
+// Archives
+//
+// An archive holds named chunks that share one pool of strings and one
+// of constants. It starts like a chunk file, with the magic "TVMA", but
+// the CRC only covers what comes before the entries; each entry has its
+// own CRC, checked when it's loaded, so that running one entry of a big
+// archive doesn't read all of it.
+//
+//   index      count entries sorted by name, each u32 offset of the name
+//              in the string pool, u32 offset and u32 size of the entry,
+//              and u32 CRC-32 of the entry
+//   strings    as in a chunk file, also holding the names
+//   constants  as in a chunk file
+//   entries    count entries, starting on a page boundary
+//
+// An entry is a u32 number of sections, four bytes of padding, a table
+// and the code, lines, stack and constants sections, with offsets from
+// the start of the entry. Its constants section is a varint offset into
+// the constant pool for each constant. Entries start on 8 byte
+// boundaries and no entry that fits in a page straddles two, so running
+// one touches few pages; code runs straight from the mapping, which
+// processes mapping the same archive share.
+//
+// Any change to the layout bumps CHUNK_VERSION; files of other versions
+// are rejected rather than guessed at.
+
+#define CHUNK_MAGIC "TVMC"
+#define ARCHIVE_MAGIC "TVMA"
+#define CHUNK_VERSION 3
+#define CHUNK_BYTE_ORDER 0xfeff
+#define HEADER_SIZE 16
+#define SECTION_ENTRY_SIZE 16
+#define SECTION_ALIGN 8
+#define ENTRY_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 16
+#define PAGE_SIZE 4096
+
+typedef enum {
+  SECTION_CODE,
+  SECTION_CONSTANTS,
+  SECTION_STRINGS,
+  SECTION_LINES,
+  SECTION_STACK,
+  SECTION_INDEX,
+  SECTION_ENTRIES,
+  SECTION_KINDS
+} SectionKind;
+
+typedef enum {
+  CONSTANT_INTEGER,
+  CONSTANT_REAL,
+  CONSTANT_STRING
+} ConstantTag;
+
+typedef struct {
+  const uint8_t* bytes;
+  uint32_t size;
+  uint32_t count;
+} Section;
+
+// A table entry for a section being written.
+typedef struct {
+  uint32_t kind;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t count;
+} SectionInfo;
+
+// A file being written.
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+// Strings and constants, each written once however often it's used. The
+// tables map each string, and the encoding of each constant, to its
+// offset in the pool.
+typedef struct {
+  Buffer strings;
+  Buffer constants;
+  uint32_t stringCount;
+  uint32_t constantCount;
+  Table stringOffsets;
+  Table constantOffsets;
+} Pools;
+
+// The unread part of a section.
+typedef struct {
+  const uint8_t* next;
+  size_t left;
+} Reader;
+
+// An archive entry waiting for its place in the index.
+typedef struct {
+  const char* name;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t crc;
+} IndexEntry;
+
+static void align(Buffer* buffer, size_t boundary);
+static void beginSection(Buffer* buffer, SectionInfo* info, SectionKind kind);
+static ChunkStatus checkArchive(Archive* archive);
+static int compareEntries(const void* a, const void* b);
+static uint32_t crc32(const uint8_t* bytes, size_t n);
+static uint32_t hashConstant(Value value);
+static void indexConstants(Chunk* chunk, int capacity);
+static ChunkStatus decodeChunk(Chunk* chunk, const uint8_t* data, size_t size);
+static ChunkStatus decodeCode(Chunk* chunk, const Section sections[], bool mapped);
+static ChunkStatus decodeEntry(Chunk* chunk, const Archive* archive, const uint8_t* data, uint32_t size);
+static void encodeChunk(Buffer* buffer, const Chunk* chunk);
+static void endSection(Buffer* buffer, SectionInfo* info);
+static void freePools(Pools* pools);
+static void initPools(Pools* pools);
+static uint32_t loadU32(const uint8_t* bytes);
+static ChunkStatus mapFile(const char* path, const uint8_t** data, size_t* size);
+static uint32_t poolConstant(Pools* pools, Value value);
+static uint32_t poolString(Pools* pools, ObjString* string);
+static void put(Buffer* buffer, const void* bytes, size_t n);
+static void putCode(Buffer* buffer, const Chunk* chunk, SectionInfo sections[]);
+static void putConstant(Buffer* buffer, Value value, uint32_t string);
+static void putHeader(Buffer* buffer, const char* magic, uint32_t nSections);
+static void putTable(Buffer* buffer, size_t at, const SectionInfo sections[], uint32_t n);
+static void putVarint(Buffer* buffer, uint64_t n);
+static void putZeros(Buffer* buffer, size_t n);
+static bool readTable(const uint8_t* base, size_t size, size_t at, uint32_t n, Section sections[]);
+static ChunkStatus reportStatus(ChunkStatus status, const char* path);
+static bool sameConstant(Value a, Value b);
+static void storeU32(uint8_t* bytes, uint32_t n);
+static bool stringAt(const Section* strings, uint64_t offset, const uint8_t** chars, uint64_t* length);
+static const uint8_t* take(Reader* reader, size_t n);
+static bool takeConstant(Reader* reader, const Section* strings, Value* value);
+static bool takeVarint(Reader* reader, uint64_t* n);
+static ChunkStatus verifyCode(Chunk* chunk);
+static ChunkStatus writeFile(const char* path, const Buffer* buffer);
+
+// A constant already in the pool is used again rather than added twice,
+// found through the index, which is kept at most half full.
 int addConstant(Chunk* chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
-  return chunk->constants.count - 1;
+  ValueArray* constants = &chunk->constants;
+  if (2 * (constants->count + 1) > chunk->indexCapacity) {
+    indexConstants(chunk, GROW_CAPACITY(chunk->indexCapacity));
+  }
+
+  uint32_t mask = chunk->indexCapacity - 1;
+  for (uint32_t i = hashConstant(value) & mask;; i = (i + 1) & mask) {
+    int n = chunk->constantIndex[i];
+    if (n == 0) {
+      writeValueArray(constants, value);
+      chunk->constantIndex[i] = constants->count;
+      return constants->count - 1;
+    }
+    if (sameConstant(constants->values[n - 1], value)) {
+      return n - 1;
+    }
+  }
+}
+
+// Pads with zeros to the next multiple of boundary.
+static void align(Buffer* buffer, size_t boundary) {
+  putZeros(buffer, (boundary - buffer->count % boundary) % boundary);
+}
+
+static void beginSection(Buffer* buffer, SectionInfo* info, SectionKind kind) {
+  align(buffer, SECTION_ALIGN);
+  info->kind = kind;
+  info->offset = buffer->count;
+  info->count = 0;
+}
+
+// Writes the chunk by way of a temporary file, so that a reader never
+// sees it half written. Unlike saveChunk, fails quietly.
+bool cacheChunk(const Chunk* chunk, const char* path) {
+  Buffer buffer = { NULL, 0, 0 };
+  encodeChunk(&buffer, chunk);
+
+  size_t length = strlen(path) + 32;
+  char* temporary = ALLOCATE(char, length);
+  snprintf(temporary, length, "%s.%ld", path, (long)getpid());
+  FILE* file = fopen(temporary, "wb");
+  bool written = file != NULL && fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+  written = file != NULL && fclose(file) == 0 && written;
+  if (!written || rename(temporary, path) != 0) {
+    remove(temporary);
+    written = false;
+  }
+
+  FREE_ARRAY(char, temporary, length);
+  FREE_ARRAY(uint8_t, buffer.bytes, buffer.capacity);
+  return written;
+}
+
+// Checks the header, the index and the pools, and notes where they are.
+static ChunkStatus checkArchive(Archive* archive) {
+  const uint8_t* data = archive->data;
+  size_t size = archive->size;
+  if (size < HEADER_SIZE || memcmp(data, ARCHIVE_MAGIC, 4) != 0) {
+    return CHUNK_NOT_AN_ARCHIVE;
+  }
+  if ((data[4] | data[5] << 8) != CHUNK_VERSION || (data[6] | data[7] << 8) != CHUNK_BYTE_ORDER) {
+    return CHUNK_STALE;
+  }
+  Section sections[SECTION_KINDS] = { { NULL, 0, 0 } };
+  if (!readTable(data, size, HEADER_SIZE, loadU32(data + 12), sections)) {
+    return CHUNK_CORRUPT;
+  }
+  if (sections[SECTION_INDEX].bytes == NULL || sections[SECTION_STRINGS].bytes == NULL ||
+      sections[SECTION_CONSTANTS].bytes == NULL || sections[SECTION_ENTRIES].bytes == NULL) {
+    return CHUNK_CORRUPT;
+  }
+
+  // Everything the CRC covers comes before the entries.
+  size_t entries = sections[SECTION_ENTRIES].bytes - data;
+  Section* index = &sections[SECTION_INDEX];
+  if (entries < HEADER_SIZE || crc32(data + 12, entries - 12) != loadU32(data + 8) ||
+      index->size != (uint64_t)index->count * INDEX_ENTRY_SIZE || index->count > INT32_MAX) {
+    return CHUNK_CORRUPT;
+  }
+
+  archive->count = index->count;
+  archive->index = index->bytes;
+  archive->strings = sections[SECTION_STRINGS].bytes;
+  archive->stringsSize = sections[SECTION_STRINGS].size;
+  archive->constants = sections[SECTION_CONSTANTS].bytes;
+  archive->constantsSize = sections[SECTION_CONSTANTS].size;
+  archive->entries = entries;
+  return CHUNK_OK;
+}
+
+void closeArchive(Archive* archive) {
+  if (archive->data != NULL) {
+    munmap((void*)archive->data, archive->size);
+  }
+  FREE(Archive, archive);
+}
+
+static int compareEntries(const void* a, const void* b) {
+  return strcmp(((const IndexEntry*)a)->name, ((const IndexEntry*)b)->name);
+}
+
+static uint32_t crc32(const uint8_t* bytes, size_t n) {
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < n; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// Fills in an empty chunk from the bytes of a chunk file. Sizes and
+// counts are checked against the data before anything is copied.
+static ChunkStatus decodeChunk(Chunk* chunk, const uint8_t* data, size_t size) {
+  bool archive = size >= HEADER_SIZE && memcmp(data, ARCHIVE_MAGIC, 4) == 0;
+  if (size < HEADER_SIZE || (memcmp(data, CHUNK_MAGIC, 4) != 0 && !archive)) {
+    return CHUNK_NOT_A_CHUNK;
+  }
+  if ((data[4] | data[5] << 8) != CHUNK_VERSION || (data[6] | data[7] << 8) != CHUNK_BYTE_ORDER) {
+    return CHUNK_STALE;
+  }
+  if (archive) {
+    return CHUNK_ARCHIVE;
+  }
+  if (crc32(data + 12, size - 12) != loadU32(data + 8)) {
+    return CHUNK_CORRUPT;
+  }
+
+  Section sections[SECTION_KINDS] = { { NULL, 0, 0 } };
+  if (!readTable(data, size, HEADER_SIZE, loadU32(data + 12), sections) ||
+      sections[SECTION_CONSTANTS].bytes == NULL || sections[SECTION_STRINGS].bytes == NULL) {
+    return CHUNK_CORRUPT;
+  }
+  ChunkStatus status = decodeCode(chunk, sections, false);
+  if (status != CHUNK_OK) { return status; }
+
+  // Each constant takes at least its tag.
+  Section* constants = &sections[SECTION_CONSTANTS];
+  if (constants->count > constants->size || constants->count > INT32_MAX) {
+    return CHUNK_CORRUPT;
+  }
+  ValueArray* values = &chunk->constants;
+  values->values = ALLOCATE(Value, constants->count);
+  values->capacity = constants->count;
+  Reader reader = { constants->bytes, constants->size };
+  for (uint32_t i = 0; i < constants->count; i++) {
+    if (!takeConstant(&reader, &sections[SECTION_STRINGS], &values->values[values->count])) {
+      return CHUNK_CORRUPT;
+    }
+    values->count++;
+  }
+  return verifyCode(chunk);
 }
 
+// Fills in the code and lines of an empty chunk. Code that is mapped is
+// used where it is rather than copied. The stack section isn't trusted;
+// verifyCode works the depth out again.
+static ChunkStatus decodeCode(Chunk* chunk, const Section sections[], bool mapped) {
+  const Section* code = &sections[SECTION_CODE];
+  const Section* lines = &sections[SECTION_LINES];
+  const Section* stack = &sections[SECTION_STACK];
+  if (code->bytes == NULL || lines->bytes == NULL || stack->bytes == NULL ||
+      code->count != code->size || code->count > INT32_MAX || stack->size != 4) {
+    return CHUNK_CORRUPT;
+  }
+  if (mapped) {
+    chunk->code = (uint8_t*)code->bytes;
+    chunk->count = code->count;
+  } else {
+    chunk->code = ALLOCATE(uint8_t, code->count);
+    chunk->count = chunk->capacity = code->count;
+    memcpy(chunk->code, code->bytes, code->count);
+  }
+
+  // Every run covers at least one byte, so there can't be more runs than
+  // bytes of code.
+  Reader reader = { lines->bytes, lines->size };
+  if (lines->count > code->count) { return CHUNK_CORRUPT; }
+  chunk->lines = ALLOCATE(LineStart, lines->count);
+  chunk->lineCapacity = lines->count;
+  int offset = 0;
+  int64_t line = 0;
+  for (uint32_t i = 0; i < lines->count; i++) {
+    uint64_t length;
+    uint64_t delta;
+    if (!takeVarint(&reader, &length) || !takeVarint(&reader, &delta) ||
+        length == 0 || length > (uint64_t)(chunk->count - offset)) {
+      return CHUNK_CORRUPT;
+    }
+    line += (int64_t)(delta >> 1) ^ -(int64_t)(delta & 1);
+    chunk->lines[chunk->lineCount++] = (LineStart){ offset, (int)line };
+    offset += (int)length;
+  }
+  return offset == chunk->count ? CHUNK_OK : CHUNK_CORRUPT;
+}
+
+// The sections of an archive entry, which has been checked against the
+// index, with its constants taken from the archive's pool.
+static ChunkStatus decodeEntry(Chunk* chunk, const Archive* archive, const uint8_t* data, uint32_t size) {
+  Section sections[SECTION_KINDS] = { { NULL, 0, 0 } };
+  if (!readTable(data, size, ENTRY_HEADER_SIZE, loadU32(data), sections) ||
+      sections[SECTION_CONSTANTS].bytes == NULL) {
+    return CHUNK_CORRUPT;
+  }
+  ChunkStatus status = decodeCode(chunk, sections, true);
+  if (status != CHUNK_OK) { return status; }
+
+  // Each constant takes at least one byte of offset.
+  Section* constants = &sections[SECTION_CONSTANTS];
+  if (constants->count > constants->size) { return CHUNK_CORRUPT; }
+  Section strings = { archive->strings, archive->stringsSize, 0 };
+  ValueArray* values = &chunk->constants;
+  values->values = ALLOCATE(Value, constants->count);
+  values->capacity = constants->count;
+  Reader reader = { constants->bytes, constants->size };
+  for (uint32_t i = 0; i < constants->count; i++) {
+    uint64_t at;
+    if (!takeVarint(&reader, &at) || at >= archive->constantsSize) { return CHUNK_CORRUPT; }
+    Reader constant = { archive->constants + at, archive->constantsSize - at };
+    if (!takeConstant(&constant, &strings, &values->values[values->count])) { return CHUNK_CORRUPT; }
+    values->count++;
+  }
+  return verifyCode(chunk);
+}
+
+static void encodeChunk(Buffer* buffer, const Chunk* chunk) {
+  Pools pools;
+  initPools(&pools);
+  SectionInfo sections[5];
+  putHeader(buffer, CHUNK_MAGIC, 5);
+  putCode(buffer, chunk, sections);
+
+  // Strings go into the pool once however many constants refer to them.
+  const ValueArray* constants = &chunk->constants;
+  beginSection(buffer, &sections[3], SECTION_CONSTANTS);
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    putConstant(buffer, value, IS_STRING(value) ? poolString(&pools, AS_STRING(value)) : 0);
+  }
+  sections[3].count = constants->count;
+  endSection(buffer, &sections[3]);
+
+  beginSection(buffer, &sections[4], SECTION_STRINGS);
+  put(buffer, pools.strings.bytes, pools.strings.count);
+  sections[4].count = pools.stringCount;
+  endSection(buffer, &sections[4]);
+
+  putTable(buffer, HEADER_SIZE, sections, 5);
+  storeU32(buffer->bytes + 8, crc32(buffer->bytes + 12, buffer->count - 12));
+  freePools(&pools);
+}
+
+static void endSection(Buffer* buffer, SectionInfo* info) {
+  info->size = buffer->count - info->offset;
+}
+
+// Code borrowed from an archive (capacity 0) belongs to the mapping.
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  if (chunk->capacity > 0) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  }
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(int, chunk->constantIndex, chunk->indexCapacity);
   initChunk(chunk);
 }
 
+static void freePools(Pools* pools) {
+  FREE_ARRAY(uint8_t, pools->strings.bytes, pools->strings.capacity);
+  FREE_ARRAY(uint8_t, pools->constants.bytes, pools->constants.capacity);
+  freeTable(&pools->stringOffsets);
+  freeTable(&pools->constantOffsets);
+}
+
+// Binary search for the last run starting at or before offset.
+int getLine(const Chunk* chunk, int offset) {
+  int lo = 0;
+  int hi = chunk->lineCount - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return chunk->lineCount == 0 ? 0 : chunk->lines[lo].line;
+}
+
+// Equal constants, as sameConstant has them, hash the same.
+static uint32_t hashConstant(Value value) {
+  uint64_t bits;
+  switch (value.type) {
+  case VAL_INTEGER: bits = (uint32_t)AS_INTEGER(value); break;
+  case VAL_REAL: memcpy(&bits, &AS_REAL(value), sizeof(double)); break;
+  default: bits = IS_STRING(value) ? AS_STRING(value)->hash : (uintptr_t)AS_OBJ(value); break;
+  }
+  bits = (bits ^ (bits >> 32) ^ value.type) * 0x9e3779b97f4a7c15;
+  return (uint32_t)(bits >> 32);
+}
+
+// Places every constant in a new index of capacity slots, a power of two.
+static void indexConstants(Chunk* chunk, int capacity) {
+  FREE_ARRAY(int, chunk->constantIndex, chunk->indexCapacity);
+  chunk->constantIndex = ALLOCATE(int, capacity);
+  chunk->indexCapacity = capacity;
+  memset(chunk->constantIndex, 0, capacity * sizeof(int));
+
+  uint32_t mask = capacity - 1;
+  for (int n = 0; n < chunk->constants.count; n++) {
+    uint32_t i = hashConstant(chunk->constants.values[n]) & mask;
+    while (chunk->constantIndex[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    chunk->constantIndex[i] = n + 1;
+  }
+}
+
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->stackDepth = 0;
   initValueArray(&chunk->constants);
+  chunk->constantIndex = NULL;
+  chunk->indexCapacity = 0;
 }
 
-Chunk* loadChunk(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file '%s'.\n", path);
-    exit(74);
+static void initPools(Pools* pools) {
+  pools->strings = (Buffer){ NULL, 0, 0 };
+  pools->constants = (Buffer){ NULL, 0, 0 };
+  pools->stringCount = 0;
+  pools->constantCount = 0;
+  initTable(&pools->stringOffsets);
+  initTable(&pools->constantOffsets);
+}
+
+// Like loadChunk, but for a file that may be missing, stale or damaged:
+// returns NULL without saying why.
+Chunk* loadCachedChunk(const char* path) {
+  int fd = open(path, O_RDONLY);
+  struct stat status;
+  if (fd < 0) { return NULL; }
+  if (fstat(fd, &status) != 0 || status.st_size == 0) {
+    close(fd);
+    return NULL;
   }
 
-  Chunk* chunk = (Chunk*)malloc(sizeof(Chunk));
+  size_t size = status.st_size;
+  const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) { return NULL; }
+
+  Chunk* chunk = ALLOCATE(Chunk, 1);
   initChunk(chunk);
-  
-  // read first int to get number of bytecodes
-  // now can just loop and writeChunk.... consider
-  // pre-allocating buffers...
-  int nOps;
-  int nConstants;
-  uint8_t op;
-  
-  fread(&nOps, sizeof(int), 1, file);
-  fread(&nConstants, sizeof(int), 1, file);
-  
-  for (int i = 0; i < nOps; i++) {
-    fread(&op, sizeof(uint8_t), 1, file);
-    writeChunk(chunk, op, -1);
-  }
-
-  // now read in line info and overwrite the '-1's
-  fread(chunk->lines, sizeof(int), nOps, file);
-  
-  // now read in constants
-  Value value;
-  for (int i = 0; i < nConstants; i++) {
-    fread(&value, sizeof(Value), 1, file);
-    addConstant(chunk, value);
-  }
-
-  // now read in strings
-  char buffer[255];
-  int nstrings = 0;
-  fread(&nstrings, sizeof(int), 1, file);
-  for (int i = 0; i < nstrings; i++) {
-    int constantIndex = 0;
-    int length = 0;
-    fread(&constantIndex, sizeof(int), 1, file);
-    fread(&length, sizeof(int), 1, file); // TODO: make sure string isn't too long...
-    fread(buffer, sizeof(char), length, file);
-    ObjString* s = copyString(buffer, length);
-    chunk->constants.values[constantIndex] = OBJ_VAL(s);
-  }
-  
-  fclose(file);
+  ChunkStatus decoded = decodeChunk(chunk, data, size);
+  munmap((void*)data, size);
+  if (decoded != CHUNK_OK) {
+    freeChunk(chunk);
+    FREE(Chunk, chunk);
+    return NULL;
+  }
   return chunk;
 }
 
-void saveChunk(Chunk* chunk, const char* path) {
-  FILE* file = fopen(path, "wb");
-  if (file == NULL) {
+// Maps the file and decodes it; the mapping is only needed while the
+// sections are copied out.
+ChunkStatus loadChunk(const char* path, Chunk** chunk) {
+  const uint8_t* data;
+  size_t size;
+  ChunkStatus status = mapFile(path, &data, &size);
+  if (status != CHUNK_OK) { return status; }
+
+  *chunk = ALLOCATE(Chunk, 1);
+  initChunk(*chunk);
+  status = reportStatus(decodeChunk(*chunk, data, size), path);
+  if (status != CHUNK_OK) {
+    freeChunk(*chunk);
+    FREE(Chunk, *chunk);
+    *chunk = NULL;
+  }
+
+  if (data != NULL) {
+    munmap((void*)data, size);
+  }
+  return status;
+}
+
+// Finds the entry by binary search over the index, checks it and decodes
+// it. Its constants are copied out of the pools; its code isn't.
+ChunkStatus loadEntry(Archive* archive, const char* name, Chunk** chunk) {
+  Section strings = { archive->strings, archive->stringsSize, 0 };
+  size_t nameLength = strlen(name);
+  int lo = 0;
+  int hi = archive->count - 1;
+  const uint8_t* found = NULL;
+  while (lo <= hi && found == NULL) {
+    int mid = lo + (hi - lo) / 2;
+    const uint8_t* entry = archive->index + (size_t)mid * INDEX_ENTRY_SIZE;
+    const uint8_t* chars;
+    uint64_t length;
+    if (!stringAt(&strings, loadU32(entry), &chars, &length)) {
+      return reportStatus(CHUNK_CORRUPT, archive->path);
+    }
+    int order = memcmp(chars, name, length < nameLength ? length : nameLength);
+    if (order == 0) {
+      order = length < nameLength ? -1 : length > nameLength;
+    }
+    if (order < 0) {
+      lo = mid + 1;
+    } else if (order > 0) {
+      hi = mid - 1;
+    } else {
+      found = entry;
+    }
+  }
+  if (found == NULL) {
+    fprintf(stderr, "'%s' has no entry named '%s'.\n", archive->path, name);
+    return CHUNK_NO_ENTRY;
+  }
+
+  uint32_t offset = loadU32(found + 4);
+  uint32_t size = loadU32(found + 8);
+  const uint8_t* data = archive->data + offset;
+  if (offset < archive->entries || offset % SECTION_ALIGN != 0 || offset > archive->size ||
+      size > archive->size - offset || size < ENTRY_HEADER_SIZE || crc32(data, size) != loadU32(found + 12)) {
+    return reportStatus(CHUNK_CORRUPT, archive->path);
+  }
+
+  *chunk = ALLOCATE(Chunk, 1);
+  initChunk(*chunk);
+  ChunkStatus status = decodeEntry(*chunk, archive, data, size);
+  if (status != CHUNK_OK) {
+    freeChunk(*chunk);
+    FREE(Chunk, *chunk);
+    *chunk = NULL;
+  }
+  return reportStatus(status, archive->path);
+}
+
+static uint32_t loadU32(const uint8_t* bytes) {
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+// Maps a whole file read-only. An empty file maps to NULL.
+static ChunkStatus mapFile(const char* path, const uint8_t** data, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) {
     fprintf(stderr, "Could not open file '%s'.\n", path);
-    exit(74);
+    if (fd >= 0) { close(fd); }
+    return CHUNK_UNREADABLE;
   }
 
-  fwrite(&chunk->count, sizeof(int), 1, file);
-  fwrite(&chunk->constants.count, sizeof(int), 1, file);
-  
-  size_t nWritten = fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
-  if (nWritten != chunk->count) {
-    fprintf(stderr, "Could not write bytecodes to file '%s'.\n", path);
-    fclose(file);
-    exit(74);
+  *size = status.st_size;
+  *data = *size == 0 ? NULL : mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*data == MAP_FAILED) {
+    fprintf(stderr, "Could not read file '%s'.\n", path);
+    return CHUNK_UNREADABLE;
   }
+  return CHUNK_OK;
+}
+
+// Maps the archive for as long as it's open. Only the header, the index
+// and the pools are checked here; entries are checked as they're loaded.
+ChunkStatus openArchive(const char* path, Archive** archive) {
+  const uint8_t* data;
+  size_t size;
+  ChunkStatus status = mapFile(path, &data, &size);
+  if (status != CHUNK_OK) { return status; }
 
-  nWritten = fwrite(chunk->lines, sizeof(int), chunk->count, file);
-  if (nWritten != chunk->count) {
-    fprintf(stderr, "Could not write line number information to file '%s'.\n", path);
-    fclose(file);
-    exit(74);
+  *archive = ALLOCATE(Archive, 1);
+  (*archive)->path = path;
+  (*archive)->data = data;
+  (*archive)->size = size;
+  status = reportStatus(checkArchive(*archive), path);
+  if (status != CHUNK_OK) {
+    closeArchive(*archive);
+    *archive = NULL;
   }
+  return status;
+}
+
+// The offset of the constant in the pool, adding it if it's new.
+static uint32_t poolConstant(Pools* pools, Value value) {
+  Buffer encoding = { NULL, 0, 0 };
+  putConstant(&encoding, value, IS_STRING(value) ? poolString(pools, AS_STRING(value)) : 0);
+  ObjString* key = copyString((const char*)encoding.bytes, (int)encoding.count);
+
+  Value offset;
+  if (!tableGet(&pools->constantOffsets, key, &offset)) {
+    offset = INTEGER_VAL((int)pools->constants.count);
+    put(&pools->constants, encoding.bytes, encoding.count);
+    pools->constantCount++;
+    tableSet(&pools->constantOffsets, key, offset);
+  }
+  FREE_ARRAY(uint8_t, encoding.bytes, encoding.capacity);
+  return AS_INTEGER(offset);
+}
 
-  // now write out constants
-  nWritten = fwrite(chunk->constants.values, sizeof(Value), chunk->constants.count, file);
-  if (nWritten != chunk->constants.count) {
-    fprintf(stderr, "Could not write chunk constants to file '%s'.\n", path);
-    fclose(file);
-    exit(74);
+// The offset of the string in the pool, adding it if it's new.
+static uint32_t poolString(Pools* pools, ObjString* string) {
+  Value offset;
+  if (!tableGet(&pools->stringOffsets, string, &offset)) {
+    offset = INTEGER_VAL((int)pools->strings.count);
+    putVarint(&pools->strings, string->length);
+    put(&pools->strings, string->chars, string->length);
+    pools->stringCount++;
+    tableSet(&pools->stringOffsets, string, offset);
   }
+  return AS_INTEGER(offset);
+}
 
-  // count # of strings and write it
-  int nstrings = 0;
-  for (int i = 0; i < chunk->constants.count; i++) {
-    if (IS_STRING(chunk->constants.values[i])) {
-      nstrings++;
+static void put(Buffer* buffer, const void* bytes, size_t n) {
+  if (n == 0) { return; }
+  if (buffer->count + n > buffer->capacity) {
+    size_t capacity = GROW_CAPACITY(buffer->capacity);
+    while (capacity < buffer->count + n) {
+      capacity *= 2;
     }
+    buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes, buffer->capacity, capacity);
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->bytes + buffer->count, bytes, n);
+  buffer->count += n;
+}
+
+// Writes the code, lines and stack sections, filling in the first three
+// table entries.
+static void putCode(Buffer* buffer, const Chunk* chunk, SectionInfo sections[]) {
+  beginSection(buffer, &sections[0], SECTION_CODE);
+  put(buffer, chunk->code, chunk->count);
+  sections[0].count = chunk->count;
+  endSection(buffer, &sections[0]);
+
+  beginSection(buffer, &sections[1], SECTION_LINES);
+  int64_t line = 0;
+  for (int i = 0; i < chunk->lineCount; i++) {
+    int end = i + 1 < chunk->lineCount ? chunk->lines[i + 1].offset : chunk->count;
+    int64_t delta = chunk->lines[i].line - line;
+    putVarint(buffer, end - chunk->lines[i].offset);
+    putVarint(buffer, (uint64_t)(delta << 1) ^ (uint64_t)(delta >> 63));
+    line = chunk->lines[i].line;
+    sections[1].count++;
+  }
+  endSection(buffer, &sections[1]);
+
+  beginSection(buffer, &sections[2], SECTION_STACK);
+  uint8_t depth[4];
+  storeU32(depth, stackDepth(chunk));
+  put(buffer, depth, 4);
+  sections[2].count = 1;
+  endSection(buffer, &sections[2]);
+}
+
+// string is the pool offset of a string constant's characters.
+static void putConstant(Buffer* buffer, Value value, uint32_t string) {
+  uint8_t tag = IS_INTEGER(value) ? CONSTANT_INTEGER : IS_REAL(value) ? CONSTANT_REAL : CONSTANT_STRING;
+  put(buffer, &tag, 1);
+  if (IS_INTEGER(value)) {
+    int64_t n = AS_INTEGER(value);
+    putVarint(buffer, (uint64_t)(n << 1) ^ (uint64_t)(n >> 63));
+  } else if (IS_REAL(value)) {
+    double d = AS_REAL(value);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(double));
+    uint8_t bytes[8];
+    storeU32(bytes, (uint32_t)bits);
+    storeU32(bytes + 4, (uint32_t)(bits >> 32));
+    put(buffer, bytes, 8);
+  } else {
+    putVarint(buffer, string);
   }
-  fwrite(&nstrings, sizeof(int), 1, file);
+}
 
-  // for each string, write the constant #, the string length (w/out trailing new line)
-  // and then the string
-  for (int i = 0; i < chunk->constants.count; i++) {
-    if (IS_STRING(chunk->constants.values[i])) {
-      ObjString *s = AS_STRING(chunk->constants.values[i]);
-      int l = s->length;
-      fwrite(&i, sizeof(int), 1, file);
-      fwrite(&l, sizeof(int), 1, file);
-      fwrite(s->chars, sizeof(char), l, file);
+// The header, with the CRC left 0, and room for the section table.
+static void putHeader(Buffer* buffer, const char* magic, uint32_t nSections) {
+  uint8_t header[HEADER_SIZE] = { 0 };
+  memcpy(header, magic, 4);
+  header[4] = CHUNK_VERSION & 0xff;
+  header[5] = CHUNK_VERSION >> 8;
+  header[6] = CHUNK_BYTE_ORDER & 0xff;
+  header[7] = CHUNK_BYTE_ORDER >> 8;
+  storeU32(header + 12, nSections);
+  put(buffer, header, HEADER_SIZE);
+  putZeros(buffer, nSections * SECTION_ENTRY_SIZE);
+}
+
+static void putTable(Buffer* buffer, size_t at, const SectionInfo sections[], uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    uint8_t* entry = buffer->bytes + at + i * SECTION_ENTRY_SIZE;
+    storeU32(entry, sections[i].kind);
+    storeU32(entry + 4, sections[i].offset);
+    storeU32(entry + 8, sections[i].size);
+    storeU32(entry + 12, sections[i].count);
+  }
+}
+
+static void putVarint(Buffer* buffer, uint64_t n) {
+  uint8_t bytes[10];
+  int length = 0;
+  do {
+    bytes[length] = (n & 0x7f) | (n >= 0x80 ? 0x80 : 0);
+    n >>= 7;
+    length++;
+  } while (n != 0);
+  put(buffer, bytes, length);
+}
+
+static void putZeros(Buffer* buffer, size_t n) {
+  static const uint8_t zeros[PAGE_SIZE] = { 0 };
+  for (; n > PAGE_SIZE; n -= PAGE_SIZE) {
+    put(buffer, zeros, PAGE_SIZE);
+  }
+  put(buffer, zeros, n);
+}
+
+// Reads a table of n sections at offset at from base, which is size
+// bytes long. Sections of kinds this version doesn't know are skipped.
+static bool readTable(const uint8_t* base, size_t size, size_t at, uint32_t n, Section sections[]) {
+  if (at > size || n > (size - at) / SECTION_ENTRY_SIZE) {
+    return false;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    const uint8_t* entry = base + at + i * SECTION_ENTRY_SIZE;
+    uint32_t kind = loadU32(entry);
+    uint32_t offset = loadU32(entry + 4);
+    uint32_t length = loadU32(entry + 8);
+    if (offset % SECTION_ALIGN != 0 || offset > size || length > size - offset) {
+      return false;
     }
+    if (kind < SECTION_KINDS) {
+      sections[kind] = (Section){ base + offset, length, loadU32(entry + 12) };
+    }
+  }
+  return true;
+}
+
+// Says what's wrong with the file, if anything, and passes the status on.
+static ChunkStatus reportStatus(ChunkStatus status, const char* path) {
+  switch (status) {
+  case CHUNK_OK:
+  case CHUNK_UNREADABLE:
+  case CHUNK_UNWRITABLE:
+  case CHUNK_NO_ENTRY:
+  case CHUNK_DUPLICATE_ENTRY:
+    break; // nothing to say, or said already
+  case CHUNK_NOT_A_CHUNK:
+    fprintf(stderr, "'%s' is not a chunk file.\n", path);
+    break;
+  case CHUNK_NOT_AN_ARCHIVE:
+    fprintf(stderr, "'%s' is not an archive.\n", path);
+    break;
+  case CHUNK_ARCHIVE:
+    fprintf(stderr, "'%s' is an archive; name one of its entries.\n", path);
+    break;
+  case CHUNK_STALE:
+    fprintf(stderr, "'%s' was compiled by a different version of trollc; compile it again.\n", path);
+    break;
+  case CHUNK_CORRUPT:
+    fprintf(stderr, "'%s' is corrupt.\n", path);
+    break;
   }
-  
-  fclose(file);
+  return status;
+}
+
+// Entries are written first, into a buffer of their own, so that their
+// offsets are known by the time the index is.
+ChunkStatus saveArchive(const char* path, Chunk chunks[], const char* names[], int count) {
+  Obj* mark = objectMark();
+  Pools pools;
+  initPools(&pools);
+  IndexEntry* index = ALLOCATE(IndexEntry, count);
+  Buffer entries = { NULL, 0, 0 };
+
+  for (int i = 0; i < count; i++) {
+    Buffer entry = { NULL, 0, 0 };
+    SectionInfo sections[4];
+    uint8_t header[ENTRY_HEADER_SIZE] = { 0 };
+    storeU32(header, 4);
+    put(&entry, header, ENTRY_HEADER_SIZE);
+    putZeros(&entry, 4 * SECTION_ENTRY_SIZE);
+
+    putCode(&entry, &chunks[i], sections);
+    beginSection(&entry, &sections[3], SECTION_CONSTANTS);
+    for (int j = 0; j < chunks[i].constants.count; j++) {
+      putVarint(&entry, poolConstant(&pools, chunks[i].constants.values[j]));
+    }
+    sections[3].count = chunks[i].constants.count;
+    endSection(&entry, &sections[3]);
+    putTable(&entry, ENTRY_HEADER_SIZE, sections, 4);
+
+    align(&entries, SECTION_ALIGN);
+    if (entry.count <= PAGE_SIZE && entries.count / PAGE_SIZE != (entries.count + entry.count - 1) / PAGE_SIZE) {
+      align(&entries, PAGE_SIZE);
+    }
+    index[i] = (IndexEntry){ names[i], entries.count, entry.count, crc32(entry.bytes, entry.count) };
+    put(&entries, entry.bytes, entry.count);
+    FREE_ARRAY(uint8_t, entry.bytes, entry.capacity);
+  }
+
+  qsort(index, count, sizeof(IndexEntry), compareEntries);
+  for (int i = 1; i < count; i++) {
+    if (strcmp(index[i - 1].name, index[i].name) == 0) {
+      fprintf(stderr, "More than one entry is named '%s'.\n", index[i].name);
+      FREE_ARRAY(uint8_t, entries.bytes, entries.capacity);
+      FREE_ARRAY(IndexEntry, index, count);
+      freePools(&pools);
+      freeObjectsSince(mark);
+      return CHUNK_DUPLICATE_ENTRY;
+    }
+  }
+
+  Buffer buffer = { NULL, 0, 0 };
+  SectionInfo sections[4];
+  putHeader(&buffer, ARCHIVE_MAGIC, 4);
+
+  // Entry offsets are filled in once the pools are written.
+  beginSection(&buffer, &sections[0], SECTION_INDEX);
+  for (int i = 0; i < count; i++) {
+    uint8_t bytes[INDEX_ENTRY_SIZE];
+    storeU32(bytes, poolString(&pools, copyString(index[i].name, (int)strlen(index[i].name))));
+    storeU32(bytes + 4, index[i].offset);
+    storeU32(bytes + 8, index[i].size);
+    storeU32(bytes + 12, index[i].crc);
+    put(&buffer, bytes, INDEX_ENTRY_SIZE);
+  }
+  sections[0].count = count;
+  endSection(&buffer, &sections[0]);
+
+  beginSection(&buffer, &sections[1], SECTION_STRINGS);
+  put(&buffer, pools.strings.bytes, pools.strings.count);
+  sections[1].count = pools.stringCount;
+  endSection(&buffer, &sections[1]);
+
+  beginSection(&buffer, &sections[2], SECTION_CONSTANTS);
+  put(&buffer, pools.constants.bytes, pools.constants.count);
+  sections[2].count = pools.constantCount;
+  endSection(&buffer, &sections[2]);
+
+  align(&buffer, PAGE_SIZE);
+  sections[3] = (SectionInfo){ SECTION_ENTRIES, buffer.count, entries.count, count };
+  for (int i = 0; i < count; i++) {
+    uint8_t* entry = buffer.bytes + sections[0].offset + i * INDEX_ENTRY_SIZE;
+    storeU32(entry + 4, sections[3].offset + index[i].offset);
+  }
+  putTable(&buffer, HEADER_SIZE, sections, 4);
+  storeU32(buffer.bytes + 8, crc32(buffer.bytes + 12, buffer.count - 12));
+  put(&buffer, entries.bytes, entries.count);
+
+  ChunkStatus status = writeFile(path, &buffer);
+  FREE_ARRAY(uint8_t, buffer.bytes, buffer.capacity);
+  FREE_ARRAY(uint8_t, entries.bytes, entries.capacity);
+  FREE_ARRAY(IndexEntry, index, count);
+  freePools(&pools);
+  freeObjectsSince(mark);
+  return status;
+}
+
+ChunkStatus saveChunk(Chunk* chunk, const char* path) {
+  Buffer buffer = { NULL, 0, 0 };
+  encodeChunk(&buffer, chunk);
+  ChunkStatus status = writeFile(path, &buffer);
+  FREE_ARRAY(uint8_t, buffer.bytes, buffer.capacity);
+  return status;
+}
+
+// Reals are compared bit for bit, so that 0.0 and -0.0 stay apart.
+static bool sameConstant(Value a, Value b) {
+  if (a.type != b.type) { return false; }
+  switch (a.type) {
+  case VAL_INTEGER: return AS_INTEGER(a) == AS_INTEGER(b);
+  case VAL_REAL: return memcmp(&AS_REAL(a), &AS_REAL(b), sizeof(double)) == 0;
+  case VAL_OBJ:
+    return IS_STRING(a) && IS_STRING(b) && AS_STRING(a)->length == AS_STRING(b)->length &&
+           memcmp(AS_STRING(a)->chars, AS_STRING(b)->chars, AS_STRING(a)->length) == 0;
+  }
+  return false;
+}
+
+// Jumps only go forward, so one pass in order sees every way into an
+// instruction before the instruction itself. -1 if the code isn't what
+// the compiler could have written: an unknown opcode, an operand or jump
+// past the end or into another instruction, a constant that isn't there,
+// a value taken from an empty stack, paths that meet with different
+// depths, or no return at the end.
+int stackDepth(const Chunk* chunk) {
+  // Operand bytes, values taken and values left by each instruction.
+  // OP_ADD2CLLCTN and OP_EXTEND_CLLCTN also take as many values as their
+  // operand says; OP_RETURN leaves its value for runSample to pop.
+  static const struct {
+    uint8_t operands;
+    uint8_t pops;
+    uint8_t pushes;
+  } instructions[] = {
+    [OP_ADD] = { 0, 2, 1 }, [OP_ADD2CLLCTN] = { 1, 1, 1 }, [OP_AND] = { 0, 2, 1 },
+    [OP_CHOOSE] = { 0, 1, 1 }, [OP_CONSTANT] = { 1, 0, 1 }, [OP_CONSTANT_LONG] = { 3, 0, 1 },
+    [OP_COUNT] = { 0, 1, 1 }, [OP_DEFINE_GLOBAL] = { 1, 1, 0 }, [OP_DEFINE_GLOBAL_LONG] = { 3, 1, 0 },
+    [OP_DIE] = { 0, 1, 1 }, [OP_DIFFERENT] = { 0, 1, 1 }, [OP_DIVIDE] = { 0, 2, 1 },
+    [OP_DROP] = { 0, 2, 1 }, [OP_EQ] = { 0, 2, 1 }, [OP_EXTEND_CLLCTN] = { 1, 1, 1 },
+    [OP_FIRST] = { 0, 1, 1 }, [OP_GE] = { 0, 2, 1 }, [OP_GET_GLOBAL] = { 1, 0, 1 },
+    [OP_GET_GLOBAL_LONG] = { 3, 0, 1 }, [OP_GT] = { 0, 2, 1 }, [OP_HCONC] = { 0, 2, 1 },
+    [OP_JUMP] = { 2, 0, 0 }, [OP_JUMP_IF_EMPTY] = { 2, 1, 0 }, [OP_JUMP_IF_EMPTY_LONG] = { 4, 1, 0 },
+    [OP_JUMP_LONG] = { 4, 0, 0 }, [OP_KEEP] = { 0, 2, 1 }, [OP_LARGEST] = { 0, 2, 1 },
+    [OP_LE] = { 0, 2, 1 }, [OP_LEAST] = { 0, 2, 1 }, [OP_LT] = { 0, 2, 1 },
+    [OP_MAX] = { 0, 1, 1 }, [OP_MAXIMAL] = { 0, 1, 1 }, [OP_MDIE] = { 0, 2, 1 },
+    [OP_MEDIAN] = { 0, 1, 1 }, [OP_MIN] = { 0, 1, 1 }, [OP_MINIMAL] = { 0, 1, 1 },
+    [OP_MKCOLLECTION] = { 0, 0, 1 }, [OP_MKPAIR] = { 0, 2, 1 }, [OP_MOD] = { 0, 2, 1 },
+    [OP_MULTIPLY] = { 0, 2, 1 }, [OP_MZDIE] = { 0, 2, 1 }, [OP_NEGATE] = { 0, 1, 1 },
+    [OP_NEQ] = { 0, 2, 1 }, [OP_NOT] = { 0, 1, 1 }, [OP_PICK] = { 0, 2, 1 },
+    [OP_QUESTION] = { 0, 1, 1 }, [OP_RANGE] = { 0, 2, 1 }, [OP_RETURN] = { 0, 1, 1 },
+    [OP_SECOND] = { 0, 1, 1 }, [OP_SETMINUS] = { 0, 2, 1 }, [OP_SGN] = { 0, 1, 1 },
+    [OP_SUBTRACT] = { 0, 2, 1 }, [OP_SUM] = { 0, 1, 1 }, [OP_UNION] = { 0, 2, 1 },
+    [OP_VCONCC] = { 0, 2, 1 }, [OP_VCONCL] = { 0, 2, 1 }, [OP_VCONCR] = { 0, 2, 1 },
+    [OP_ZERO_DIE] = { 0, 1, 1 }
+  };
+
+  int* depths = ALLOCATE(int, chunk->count + 1); // on arriving by a jump
+  for (int i = 0; i <= chunk->count; i++) {
+    depths[i] = -1;
+  }
+
+  int depth = 0;
+  int deepest = 0;
+  bool fallsThrough = true;
+  bool valid = true;
+  for (int offset = 0; valid && offset < chunk->count;) {
+    uint8_t op = chunk->code[offset];
+    int next = offset + 1 + (op <= OP_ZERO_DIE ? instructions[op].operands : 0);
+    if (op > OP_ZERO_DIE || next > chunk->count) {
+      valid = false;
+      break;
+    }
+    // Every way in must leave the stack as deep, as the compiler's code
+    // does, or a shallower one could pop what isn't there.
+    if (!fallsThrough) {
+      depth = depths[offset] > 0 ? depths[offset] : 0;
+    } else if (depths[offset] >= 0 && depths[offset] != depth) {
+      valid = false;
+    }
+
+    // Jumps only go forward, so any into this instruction's operands
+    // have been seen.
+    for (int i = offset + 1; i < next; i++) {
+      valid = valid && depths[i] < 0;
+    }
+
+    int pops = instructions[op].pops;
+    if (op == OP_ADD2CLLCTN || op == OP_EXTEND_CLLCTN) {
+      pops += chunk->code[offset + 1];
+    }
+    valid = valid && depth >= pops;
+    depth += instructions[op].pushes - pops;
+    if (depth > deepest) { deepest = depth; }
+
+    // Globals are named by string constants.
+    int64_t constant = -1;
+    if (op == OP_CONSTANT || op == OP_DEFINE_GLOBAL || op == OP_GET_GLOBAL) {
+      constant = chunk->code[offset + 1];
+    } else if (op == OP_CONSTANT_LONG || op == OP_DEFINE_GLOBAL_LONG || op == OP_GET_GLOBAL_LONG) {
+      constant = chunk->code[offset + 1] << 16 | chunk->code[offset + 2] << 8 | chunk->code[offset + 3];
+    }
+    if (constant >= chunk->constants.count) {
+      valid = false;
+    } else if (constant >= 0 && op != OP_CONSTANT && op != OP_CONSTANT_LONG) {
+      valid = valid && IS_STRING(chunk->constants.values[constant]);
+    }
+
+    int64_t target = -1;
+    if (op == OP_JUMP || op == OP_JUMP_IF_EMPTY) {
+      target = next + (chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+    } else if (op == OP_JUMP_LONG || op == OP_JUMP_IF_EMPTY_LONG) {
+      target = next + ((uint32_t)chunk->code[offset + 1] << 24 | chunk->code[offset + 2] << 16 |
+                       chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
+    }
+    if (target >= chunk->count) {
+      valid = false;
+    } else if (target >= 0 && depths[target] < 0) {
+      depths[target] = depth;
+    } else if (target >= 0 && depths[target] != depth) {
+      valid = false;
+    }
+    fallsThrough = op != OP_JUMP && op != OP_JUMP_LONG && op != OP_RETURN;
+    offset = next;
+  }
+
+  FREE_ARRAY(int, depths, chunk->count + 1);
+  return valid && !fallsThrough ? deepest : -1;
+}
+
+// What a tool exits with when a file lets it down: 74 if the file
+// couldn't be read or written at all, 65 if its contents are wrong.
+int statusExitCode(ChunkStatus status) {
+  switch (status) {
+  case CHUNK_OK: return 0;
+  case CHUNK_UNREADABLE:
+  case CHUNK_UNWRITABLE: return 74;
+  default: return 65;
+  }
+}
+
+static void storeU32(uint8_t* bytes, uint32_t n) {
+  bytes[0] = n & 0xff;
+  bytes[1] = (n >> 8) & 0xff;
+  bytes[2] = (n >> 16) & 0xff;
+  bytes[3] = n >> 24;
+}
+
+// The string at offset in the pool.
+static bool stringAt(const Section* strings, uint64_t offset, const uint8_t** chars, uint64_t* length) {
+  if (offset >= strings->size) { return false; }
+  Reader reader = { strings->bytes + offset, strings->size - offset };
+  return takeVarint(&reader, length) && *length <= INT32_MAX && (*chars = take(&reader, *length)) != NULL;
+}
+
+// The next n bytes, or NULL if the section ends first.
+static const uint8_t* take(Reader* reader, size_t n) {
+  if (n > reader->left) { return NULL; }
+  const uint8_t* bytes = reader->next;
+  reader->next += n;
+  reader->left -= n;
+  return bytes;
+}
+
+// A constant as putConstant wrote it.
+static bool takeConstant(Reader* reader, const Section* strings, Value* value) {
+  const uint8_t* tag = take(reader, 1);
+  uint64_t n;
+  const uint8_t* real;
+  const uint8_t* chars;
+  if (tag == NULL) {
+    return false;
+  } else if (*tag == CONSTANT_INTEGER && takeVarint(reader, &n)) {
+    *value = INTEGER_VAL((int)((int64_t)(n >> 1) ^ -(int64_t)(n & 1)));
+  } else if (*tag == CONSTANT_REAL && (real = take(reader, 8)) != NULL) {
+    uint64_t bits = (uint64_t)loadU32(real + 4) << 32 | loadU32(real);
+    double d;
+    memcpy(&d, &bits, sizeof(double));
+    *value = REAL_VAL(d);
+  } else if (*tag == CONSTANT_STRING && takeVarint(reader, &n) && stringAt(strings, n, &chars, &n)) {
+    *value = OBJ_VAL(copyString((const char*)chars, (int)n));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// LEB128: seven bits a byte, least significant first, with the top bit
+// set on every byte but the last.
+static bool takeVarint(Reader* reader, uint64_t* n) {
+  *n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const uint8_t* byte = take(reader, 1);
+    if (byte == NULL) { return false; }
+    *n |= (uint64_t)(*byte & 0x7f) << shift;
+    if ((*byte & 0x80) == 0) { return true; }
+  }
+  return false;
+}
+
+// A file's code is only run once it's been walked the way the compiler's
+// was, since the CRC only catches damage, not a file made to mislead.
+static ChunkStatus verifyCode(Chunk* chunk) {
+  chunk->stackDepth = stackDepth(chunk);
+  return chunk->stackDepth < 0 ? CHUNK_CORRUPT : CHUNK_OK;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -139,10 +1146,33 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // A new run starts only when the line changes.
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+  }
+  chunk->lines[chunk->lineCount++] = (LineStart){ chunk->count - 1, line };
+}
+
+static ChunkStatus writeFile(const char* path, const Buffer* buffer) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file '%s'.\n", path);
+    return CHUNK_UNWRITABLE;
+  }
+  bool written = fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+  if (fclose(file) != 0 || !written) {
+    fprintf(stderr, "Could not write file '%s'.\n", path);
+    return CHUNK_UNWRITABLE;
+  }
+  return CHUNK_OK;
 }
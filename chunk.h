@@ -10,20 +10,26 @@ typedef enum {
   OP_AND,
   OP_CHOOSE,
   OP_CONSTANT,
+  OP_CONSTANT_LONG, // 24-bit constant index
   OP_COUNT,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_DIE,
   OP_DIFFERENT,
   OP_DIVIDE,
   OP_DROP,
   OP_EQ,
+  OP_EXTEND_CLLCTN, // like OP_ADD2CLLCTN, but the collection is below the ints
   OP_FIRST,
   OP_GE,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_GT,
   OP_HCONC,
   OP_JUMP,
   OP_JUMP_IF_EMPTY,
+  OP_JUMP_IF_EMPTY_LONG, // 32-bit offset
+  OP_JUMP_LONG,
   OP_KEEP,
   OP_LARGEST,
   OP_LE,
@@ -59,19 +65,69 @@ typedef enum {
   OP_ZERO_DIE
 } OpCode;
 
+// Code from offset up to the next LineStart was compiled from line.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
+// capacity is 0 when code belongs to an archive's mapping.
 typedef struct {
   int count;
   int capacity;
   uint8_t* code;
-  int* lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
   ValueArray constants;
+  int* constantIndex; // 1 + each constant's number, placed by its hash
+  int indexCapacity;
+  int stackDepth; // the most values the code ever has on the stack
 } Chunk;
 
+// Why a file couldn't be read or written. The functions that return one
+// have already said why on stderr.
+typedef enum {
+  CHUNK_OK,
+  CHUNK_UNREADABLE,
+  CHUNK_UNWRITABLE,
+  CHUNK_NOT_A_CHUNK,
+  CHUNK_NOT_AN_ARCHIVE,
+  CHUNK_ARCHIVE,
+  CHUNK_STALE,
+  CHUNK_CORRUPT,
+  CHUNK_NO_ENTRY,
+  CHUNK_DUPLICATE_ENTRY
+} ChunkStatus;
+
+// Named chunks in one file, mapped for as long as it's open; see chunk.c.
+typedef struct {
+  const char* path;
+  const uint8_t* data;
+  size_t size;
+  int count;
+  const uint8_t* index;
+  const uint8_t* strings;
+  uint32_t stringsSize;
+  const uint8_t* constants;
+  uint32_t constantsSize;
+  size_t entries; // offset of the first entry
+} Archive;
+
 int addConstant(Chunk* chunk, Value value);
+bool cacheChunk(const Chunk* chunk, const char* path);
+void closeArchive(Archive* archive);
 void freeChunk(Chunk* chunk);
+int getLine(const Chunk* chunk, int offset);
 void initChunk(Chunk* chunk);
-Chunk* loadChunk(const char* path);
-void saveChunk(Chunk* chunk, const char* path);
+Chunk* loadCachedChunk(const char* path);
+ChunkStatus loadChunk(const char* path, Chunk** chunk);
+ChunkStatus loadEntry(Archive* archive, const char* name, Chunk** chunk);
+ChunkStatus openArchive(const char* path, Archive** archive);
+ChunkStatus saveArchive(const char* path, Chunk chunks[], const char* names[], int count);
+ChunkStatus saveChunk(Chunk* chunk, const char* path);
+int stackDepth(const Chunk* chunk);
+int statusExitCode(ChunkStatus status);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
 #endif
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define CACHE_LINE 64
+
 // #define DEBUG_TRACE_EXECUTION -- TODO: command line opts to turn this off and on
 
 #endif
@@ -5,6 +5,9 @@
 #include "compiler.h"
 #include "scanner.h"
 
+// Expressions in a collection literal that are on the stack at once.
+#define COLLECTION_GROUP 32
+
 static void advance(void);
 static void errorAt(Token* token, const char* message);
 static void error(const char* message);
@@ -17,7 +20,8 @@ static void emitBytes(uint8_t byte1, uint8_t byte2);
 static void expression(void);
 static void integer(void);
 static void emitConstant(Value value);
-static uint8_t makeConstant(Value value);
+static void emitConstantOp(uint8_t instruction, uint8_t longInstruction, int constant);
+static int makeConstant(Value value);
 static void grouping(void);
 static void unary(void);
 static void dieroll(void);
@@ -37,6 +41,8 @@ typedef struct {
   Token previous;
   bool hadError;
   bool panicMode;
+  bool jumpTooFar; // for a 16-bit jump
+  FILE* errors;
 } Parser;
 
 typedef enum {
@@ -65,8 +71,10 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk* compilingChunk;
+// Like the scanner, one per thread.
+static _Thread_local Parser parser;
+static _Thread_local Chunk* compilingChunk;
+static _Thread_local bool wideJumps; // every jump has a 32-bit offset
 
 static void parsePrecedence(Precedence precedence);
 
@@ -80,23 +88,44 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-bool compile(const char* source, Chunk *chunk) {
-  initScanner(source);
-  compilingChunk = chunk;
-  
-  parser.panicMode = false;
-  parser.hadError = false;
-  
-  advance();
-  expression();
-  consume(TOKEN_EOF, "Expected end of expression.");
-  endCompiler();
-  
+// Jumps are emitted with 16-bit offsets. Only if one of them turns out
+// to need more is the whole chunk compiled again with 32-bit ones. Error
+// messages go to errors.
+bool compile(const char* source, Chunk *chunk, FILE* errors) {
+  for (wideJumps = false;; wideJumps = true) {
+    initScanner(source);
+    compilingChunk = chunk;
+
+    parser.panicMode = false;
+    parser.hadError = false;
+    parser.jumpTooFar = false;
+    parser.errors = errors;
+
+    advance();
+    expression();
+    consume(TOKEN_EOF, "Expected end of expression.");
+    endCompiler();
+
+    if (!parser.jumpTooFar || parser.hadError) { break; }
+    freeChunk(chunk);
+  }
+
   return !parser.hadError;
 }
 
+// The chunk's depth is worked out the way a chunk file's is, and a
+// program that needs more than the VM's stack is an error here rather
+// than an overflow when it runs.
 static void endCompiler() {
   emitReturn();
+  if (parser.hadError || parser.jumpTooFar) { return; }
+
+  Chunk* chunk = currentChunk();
+  chunk->stackDepth = stackDepth(chunk);
+  if (chunk->stackDepth > STACK_MAX) {
+    fprintf(parser.errors, "The program needs a deeper stack than tvm has.\n");
+    parser.hadError = true;
+  }
 }
 
 static void advance() {
@@ -122,17 +151,17 @@ static void errorAt(Token* token, const char* message) {
   if (parser.panicMode) { return; }
   parser.panicMode = true;
   
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(parser.errors, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(parser.errors, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(parser.errors, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  fprintf(parser.errors, ": %s\n", message);
   parser.hadError = true;
 }
 
@@ -169,6 +198,12 @@ static void emitReturn() {
 }
 
 static int emitJump(uint8_t instruction) {
+  if (wideJumps) {
+    emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_EMPTY_LONG);
+    emitBytes(0xff, 0xff);
+    emitBytes(0xff, 0xff);
+    return currentChunk()->count - 4;
+  }
   emitByte(instruction);
   emitByte(0xff);
   emitByte(0xff);
@@ -176,14 +211,23 @@ static int emitJump(uint8_t instruction) {
 }
 
 static void patchJump(int offset) {
-  int jump = currentChunk()->count - offset - 2;
+  uint8_t* code = currentChunk()->code;
+  if (wideJumps) {
+    uint32_t jump = currentChunk()->count - offset - 4;
+    code[offset] = jump >> 24;
+    code[offset + 1] = (jump >> 16) & 0xff;
+    code[offset + 2] = (jump >> 8) & 0xff;
+    code[offset + 3] = jump & 0xff;
+    return;
+  }
 
+  int jump = currentChunk()->count - offset - 2;
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    parser.jumpTooFar = true;
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  code[offset] = (jump >> 8) & 0xff;
+  code[offset + 1] = jump & 0xff;
 }
 
 static void integer() {
@@ -192,17 +236,28 @@ static void integer() {
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitConstantOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+// The long form of the instruction takes a 24-bit index, and is only
+// used for constants past the first 256.
+static void emitConstantOp(uint8_t instruction, uint8_t longInstruction, int constant) {
+  if (constant <= UINT8_MAX) {
+    emitBytes(instruction, constant);
+  } else {
+    emitBytes(longInstruction, constant >> 16);
+    emitBytes((constant >> 8) & 0xff, constant & 0xff);
+  }
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > 0xffffff) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
 }
 
 static void grouping() {
@@ -223,16 +278,16 @@ static void ll() {
   }
 }
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
-static void defineVariable(uint8_t global) {
-  emitBytes(OP_DEFINE_GLOBAL, global);
+static void defineVariable(int global) {
+  emitConstantOp(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static void variable() {
-  uint8_t global = identifierConstant(&parser.previous);
+  int global = identifierConstant(&parser.previous);
   
   if (match(TOKEN_ASSIGN)) {
     // we're assigning to a new variable
@@ -242,7 +297,7 @@ static void variable() {
     expression();
   } else {
     // we're referencing an existing variable
-    emitBytes(OP_GET_GLOBAL, global);
+    emitConstantOp(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, global);
   }
 }
 
@@ -344,13 +399,18 @@ static void question() {
   emitByte(OP_QUESTION);
 }
 
+// The collection is made first and expressions are added to it
+// COLLECTION_GROUP at a time, so however long the literal only a group
+// of them is ever on the stack.
 static void collection() {
-  uint8_t count = 0;
-  
+  emitByte(OP_MKCOLLECTION);
+  int count = 0; // expressions not yet added
+
   if (parser.current.type != TOKEN_RBRACE) {
     while (1) {
-      if (count == 255) {
-        errorAtCurrent("Collections cannot contain more than 256 expressions.");
+      if (count == COLLECTION_GROUP) {
+        emitBytes(OP_EXTEND_CLLCTN, count);
+        count = 0;
       }
       expression();
       count++;
@@ -364,10 +424,8 @@ static void collection() {
 
   consume(TOKEN_RBRACE, "Expecting '}' at end of collection.");
 
-  emitByte(OP_MKCOLLECTION);
-
   if (count > 0) {
-    emitBytes(OP_ADD2CLLCTN, count);
+    emitBytes(OP_EXTEND_CLLCTN, count);
   }
 }
 
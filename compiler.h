@@ -1,9 +1,16 @@
 #ifndef tvm_compiler_h
 #define tvm_compiler_h
 
+#include <stdio.h>
+
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+// Bumped with any change to the code compile writes for a given source,
+// or to what that code means, so that cached chunks (see cache.h) from an
+// older tvm are compiled again.
+#define COMPILER_VERSION 2
+
+bool compile(const char* source, Chunk* chunk, FILE* errors);
 
 #endif
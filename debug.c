@@ -25,6 +25,14 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t constant = chunk->code[offset + 1] << 16 | chunk->code[offset + 2] << 8 | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
@@ -32,6 +40,13 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+static int jumpLongInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t jump = (uint32_t)chunk->code[offset + 1] << 24 | chunk->code[offset + 2] << 16 |
+                  chunk->code[offset + 3] << 8 | chunk->code[offset + 4];
+  printf("%-16s %4d -> %u\n", name, offset, offset + 5 + jump);
+  return offset + 5;
+}
+
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -39,10 +54,11 @@ static int simpleInstruction(const char* name, int offset) {
 
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
   
   uint8_t instruction = chunk->code[offset];
@@ -57,10 +73,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_CHOOSE", offset);
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
   case OP_COUNT:
     return simpleInstruction("OP_COUNT", offset);
   case OP_DEFINE_GLOBAL:
     return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
   case OP_DIE:
     return simpleInstruction("OP_DIE", offset);
   case OP_DIFFERENT:
@@ -71,12 +91,16 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_DROP", offset);
   case OP_EQ:
     return simpleInstruction("OP_EQ", offset);
+  case OP_EXTEND_CLLCTN:
+    return byteInstruction("OP_EXTEND_CLLCTN", chunk, offset);
   case OP_FIRST:
     return simpleInstruction("OP_FIRST", offset);
   case OP_GE:
     return simpleInstruction("OP_GE", offset);
   case OP_GET_GLOBAL:
     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
   case OP_GT:
     return simpleInstruction("OP_GT", offset);
   case OP_HCONC:
@@ -85,6 +109,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return jumpInstruction("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_EMPTY:
     return jumpInstruction("OP_JUMP_IF_EMPTY", 1, chunk, offset);
+  case OP_JUMP_IF_EMPTY_LONG:
+    return jumpLongInstruction("OP_JUMP_IF_EMPTY_LONG", chunk, offset);
+  case OP_JUMP_LONG:
+    return jumpLongInstruction("OP_JUMP_LONG", chunk, offset);
   case OP_KEEP:
     return simpleInstruction("OP_KEEP", offset);
   case OP_LARGEST:
@@ -4,16 +4,33 @@
 #include "chunk.h"
 #include "debug.h"
 
+static void check(ChunkStatus status) {
+  if (status != CHUNK_OK) {
+    exit(statusExitCode(status));
+  }
+}
+
 void decom(const char* path) {
-  Chunk* chunk = loadChunk(path);
+  Chunk* chunk;
+  check(loadChunk(path, &chunk));
   disassembleChunk(chunk, path);
 }
 
+void decomEntry(const char* path, const char* name) {
+  Archive* archive;
+  check(openArchive(path, &archive));
+  Chunk* chunk;
+  check(loadEntry(archive, name, &chunk));
+  disassembleChunk(chunk, name);
+}
+
 int main(int argc, char* argv[]) {
   if (argc == 2) {
     decom(argv[1]);
+  } else if (argc == 3) {
+    decomEntry(argv[1], argv[2]);
   } else {
-    fprintf(stderr, "usage: decom <file>\n");
+    fprintf(stderr, "usage: decom <file> [entry]\n");
     exit(64);
   }
   return 0;
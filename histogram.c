@@ -0,0 +1,335 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "memory.h"
+
+#define OUTLIERS_MAX_LOAD 0.5
+
+// The first window, and the least a window may grow by to take in a
+// value. Anything that would need a window more than four times as wide
+// is an outlier.
+#define INITIAL_SPAN 64
+#define MIN_GROWTH 1024
+
+static void adjustCapacity(Histogram* histogram, int capacity);
+static Outcome* findOutlier(Outcome* outliers, int capacity, int value);
+static void moveWindow(Histogram* histogram, int64_t lo, uint64_t span);
+static void tally(Histogram* histogram, int value, uint64_t count);
+static void tallyOutlier(Histogram* histogram, int value, uint64_t count);
+
+static void adjustCapacity(Histogram* histogram, int capacity) {
+  Outcome* outliers = ALLOCATE(Outcome, capacity);
+  for (int i = 0; i < capacity; i++) {
+    outliers[i].count = 0;
+  }
+
+  for (int i = 0; i < histogram->outlierCapacity; i++) {
+    Outcome* outlier = &histogram->outliers[i];
+    if (outlier->count != 0) {
+      *findOutlier(outliers, capacity, outlier->value) = *outlier;
+    }
+  }
+
+  FREE_ARRAY(Outcome, histogram->outliers, histogram->outlierCapacity);
+  histogram->outliers = outliers;
+  histogram->outlierCapacity = capacity;
+}
+
+// Grows the window to take in value if that doesn't make it too sparse
+// or too big; otherwise value is an outlier.
+void addOutlier(Histogram* histogram, int value) {
+  if (histogram->span == 0) {
+    moveWindow(histogram, (int64_t)value - INITIAL_SPAN / 2, INITIAL_SPAN);
+    histogram->counts[INITIAL_SPAN / 2]++;
+    return;
+  }
+
+  int64_t lo = histogram->lo < value ? histogram->lo : value;
+  int64_t hi = histogram->lo + (int64_t)histogram->span;
+  if (hi < (int64_t)value + 1) { hi = (int64_t)value + 1; }
+  uint64_t needed = hi - lo;
+  uint64_t reach = histogram->span * 4 > MIN_GROWTH ? histogram->span * 4 : MIN_GROWTH;
+
+  if (needed > reach || needed > HISTOGRAM_MAX_SPAN) {
+    tallyOutlier(histogram, value, 1);
+    return;
+  }
+
+  // Leave room to keep growing in the same direction.
+  uint64_t span = histogram->span * 2 > needed ? histogram->span * 2 : needed;
+  if (span > HISTOGRAM_MAX_SPAN) { span = HISTOGRAM_MAX_SPAN; }
+  if (value < histogram->lo) {
+    moveWindow(histogram, histogram->lo + (int64_t)histogram->span - (int64_t)span, span);
+  } else {
+    moveWindow(histogram, histogram->lo, span);
+  }
+  histogram->counts[(int64_t)value - histogram->lo]++;
+}
+
+static int compareOutcomes(const void* a, const void* b) {
+  int x = ((const Outcome*)a)->value;
+  int y = ((const Outcome*)b)->value;
+  return (x > y) - (x < y);
+}
+
+// capacity is a power of two. Outliers are spread out with a
+// multiplicative hash first since they tend to be runs of integers.
+static Outcome* findOutlier(Outcome* outliers, int capacity, int value) {
+  uint32_t hash = (uint32_t)value * 2654435769u;
+  uint32_t index = (hash ^ (hash >> 16)) & (capacity - 1);
+
+  for (;;) {
+    Outcome* outlier = &outliers[index];
+    if (outlier->count == 0 || outlier->value == value) {
+      return outlier;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+void freeHistogram(Histogram* histogram) {
+  FREE_ARRAY(uint64_t, histogram->counts, histogram->span);
+  FREE_ARRAY(Outcome, histogram->outliers, histogram->outlierCapacity);
+  initHistogram(histogram);
+}
+
+double histogramMean(const Histogram* histogram) {
+  if (histogram->samples == 0) { return 0; }
+
+  int n;
+  Outcome* outcomes = sortedOutcomes(histogram, &n);
+  double sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += (double)outcomes[i].value * outcomes[i].count;
+  }
+  FREE_ARRAY(Outcome, outcomes, n);
+  return sum / histogram->samples;
+}
+
+double histogramPrecision(const Histogram* histogram, double z) {
+  if (histogram->samples == 0) { return INFINITY; }
+
+  int n;
+  Outcome* outcomes = sortedOutcomes(histogram, &n);
+  double widest = z * sqrt(histogramVariance(histogram) / histogram->samples);
+  for (int i = 0; i < n; i++) {
+    widest = fmax(widest, probabilityWidth(outcomes[i].count, histogram->samples, z));
+  }
+  FREE_ARRAY(Outcome, outcomes, n);
+  return widest;
+}
+
+// Two passes, so the variance doesn't lose precision when the mean is
+// large compared to the spread.
+double histogramVariance(const Histogram* histogram) {
+  if (histogram->samples < 2) { return 0; }
+
+  double mean = histogramMean(histogram);
+  int n;
+  Outcome* outcomes = sortedOutcomes(histogram, &n);
+  double sum = 0;
+  for (int i = 0; i < n; i++) {
+    double d = outcomes[i].value - mean;
+    sum += d * d * outcomes[i].count;
+  }
+  FREE_ARRAY(Outcome, outcomes, n);
+  return sum / (histogram->samples - 1);
+}
+
+void initHistogram(Histogram* histogram) {
+  histogram->samples = 0;
+  histogram->lo = 0;
+  histogram->span = 0;
+  histogram->counts = NULL;
+  histogram->outlierCount = 0;
+  histogram->outlierCapacity = 0;
+  histogram->outliers = NULL;
+}
+
+// Histograms with overlapping windows (the usual case, since threads run
+// the same expression) are added as vectors after widening to's window to
+// cover both. Otherwise from's counts are added one by one.
+void mergeHistogram(Histogram* to, const Histogram* from) {
+  if (from->span > 0) {
+    int64_t lo = to->lo < from->lo ? to->lo : from->lo;
+    int64_t hi = to->lo + (int64_t)to->span;
+    if (hi < from->lo + (int64_t)from->span) { hi = from->lo + (int64_t)from->span; }
+
+    if (to->span == 0) {
+      moveWindow(to, from->lo, from->span);
+    } else if ((uint64_t)(hi - lo) <= HISTOGRAM_MAX_SPAN && (lo != to->lo || (uint64_t)(hi - lo) != to->span)) {
+      moveWindow(to, lo, hi - lo);
+    }
+
+    if (from->lo >= to->lo && from->lo + (int64_t)from->span <= to->lo + (int64_t)to->span) {
+      uint64_t* counts = to->counts + (from->lo - to->lo);
+      for (uint64_t i = 0; i < from->span; i++) {
+        counts[i] += from->counts[i];
+      }
+    } else {
+      for (uint64_t i = 0; i < from->span; i++) {
+        if (from->counts[i] != 0) {
+          tally(to, (int)(from->lo + (int64_t)i), from->counts[i]);
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < from->outlierCapacity; i++) {
+    const Outcome* outlier = &from->outliers[i];
+    if (outlier->count != 0) {
+      tally(to, outlier->value, outlier->count);
+    }
+  }
+  to->samples += from->samples;
+}
+
+// Moves the counts into a window [lo, lo + span) that covers the old one,
+// and takes in any outliers that now fit.
+static void moveWindow(Histogram* histogram, int64_t lo, uint64_t span) {
+  uint64_t* counts = ALLOCATE(uint64_t, span);
+  memset(counts, 0, sizeof(uint64_t) * span);
+  if (histogram->span > 0) {
+    memcpy(counts + (histogram->lo - lo), histogram->counts, sizeof(uint64_t) * histogram->span);
+  }
+  FREE_ARRAY(uint64_t, histogram->counts, histogram->span);
+  histogram->counts = counts;
+  histogram->lo = lo;
+  histogram->span = span;
+
+  if (histogram->outlierCount == 0) { return; }
+
+  Outcome* outliers = histogram->outliers;
+  int capacity = histogram->outlierCapacity;
+  histogram->outliers = NULL;
+  histogram->outlierCount = 0;
+  histogram->outlierCapacity = 0;
+  for (int i = 0; i < capacity; i++) {
+    if (outliers[i].count != 0) {
+      tally(histogram, outliers[i].value, outliers[i].count);
+    }
+  }
+  FREE_ARRAY(Outcome, outliers, capacity);
+}
+
+// z where erf(z / sqrt 2) = confidence, by bisection.
+double normalWidth(double confidence) {
+  double lo = 0;
+  double hi = 40;
+  for (int i = 0; i < 100; i++) {
+    double mid = (lo + hi) / 2;
+    if (erf(mid / sqrt(2)) < confidence) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo + hi) / 2;
+}
+
+void printHistogram(FILE* file, const Histogram* histogram, double z) {
+  int n;
+  Outcome* outcomes = sortedOutcomes(histogram, &n);
+  double samples = histogram->samples;
+
+  if (z > 0) {
+    fprintf(file, "%11s  %-19s  %-8s  %s\n", "Value", "=", ">=", "<=");
+  } else {
+    fprintf(file, "%11s  %-8s  %-8s  %s\n", "Value", "=", ">=", "<=");
+  }
+
+  uint64_t below = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t count = outcomes[i].count;
+    fprintf(file, "%11d  %.6f", outcomes[i].value, count / samples);
+    if (z > 0) {
+      fprintf(file, " ± %.6f", probabilityWidth(count, histogram->samples, z));
+    }
+    fprintf(file, "  %.6f  %.6f\n", (histogram->samples - below) / samples, (below + count) / samples);
+    below += count;
+  }
+  FREE_ARRAY(Outcome, outcomes, n);
+
+  double variance = histogramVariance(histogram);
+  fprintf(file, "Mean = %.6f", histogramMean(histogram));
+  if (z > 0) {
+    fprintf(file, " ± %.6f", z * sqrt(variance / samples));
+  }
+  fprintf(file, "\nStandard deviation = %.6f\n", sqrt(variance));
+  fprintf(file, "Samples = %llu\n", (unsigned long long)histogram->samples);
+}
+
+// Agresti-Coull interval for a probability: adding z^2 pseudo-samples
+// keeps rare outcomes from looking more certain than they are. Returns the
+// half-width.
+double probabilityWidth(uint64_t count, uint64_t samples, double z) {
+  double n = samples + z * z;
+  double centre = (count + z * z / 2) / n;
+  return z * sqrt(centre * (1 - centre) / n);
+}
+
+uint64_t samplesNeeded(const Histogram* histogram, double z, double eps) {
+  // p(1 - p) for the probabilities and the variance for the mean.
+  double spread = histogramVariance(histogram);
+  int n;
+  Outcome* outcomes = sortedOutcomes(histogram, &n);
+  for (int i = 0; i < n; i++) {
+    double p = (double)outcomes[i].count / histogram->samples;
+    spread = fmax(spread, p * (1 - p));
+  }
+  FREE_ARRAY(Outcome, outcomes, n);
+
+  double needed = ceil(z * z * spread / (eps * eps));
+  return needed >= (double)UINT64_MAX ? UINT64_MAX : (uint64_t)needed;
+}
+
+Outcome* sortedOutcomes(const Histogram* histogram, int* count) {
+  int n = histogram->outlierCount;
+  for (uint64_t i = 0; i < histogram->span; i++) {
+    n += histogram->counts[i] != 0;
+  }
+
+  Outcome* outcomes = ALLOCATE(Outcome, n);
+  int next = 0;
+  for (uint64_t i = 0; i < histogram->span; i++) {
+    if (histogram->counts[i] != 0) {
+      outcomes[next++] = (Outcome){ (int)(histogram->lo + (int64_t)i), histogram->counts[i] };
+    }
+  }
+  for (int i = 0; i < histogram->outlierCapacity; i++) {
+    if (histogram->outliers[i].count != 0) {
+      outcomes[next++] = histogram->outliers[i];
+    }
+  }
+  if (histogram->outlierCount > 0) {
+    qsort(outcomes, n, sizeof(Outcome), compareOutcomes);
+  }
+
+  *count = n;
+  return outcomes;
+}
+
+// Adds count to value's bin without growing the window.
+static void tally(Histogram* histogram, int value, uint64_t count) {
+  uint64_t index = (uint64_t)((int64_t)value - histogram->lo);
+  if (index < histogram->span) {
+    histogram->counts[index] += count;
+  } else {
+    tallyOutlier(histogram, value, count);
+  }
+}
+
+static void tallyOutlier(Histogram* histogram, int value, uint64_t count) {
+  if (histogram->outlierCount + 1 > histogram->outlierCapacity * OUTLIERS_MAX_LOAD) {
+    adjustCapacity(histogram, GROW_CAPACITY(histogram->outlierCapacity));
+  }
+
+  Outcome* outlier = findOutlier(histogram->outliers, histogram->outlierCapacity, value);
+  if (outlier->count == 0) {
+    outlier->value = value;
+    histogram->outlierCount++;
+  }
+  outlier->count += count;
+}
@@ -0,0 +1,78 @@
+#ifndef tvm_histogram_h
+#define tvm_histogram_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// How often each integer result came up. Counts live in a dense array over
+// a window [lo, lo + span) that grows to fit the results seen; values too
+// far outside it to be worth growing for (a rare huge result, say) go into
+// a small hash table of outliers instead. Every sampling thread fills its
+// own histogram and they're merged at the end of each batch.
+
+// Largest window, in counts (2MB).
+#define HISTOGRAM_MAX_SPAN (1 << 18)
+
+typedef struct {
+  int value;
+  uint64_t count; // 0 marks an empty slot
+} Outcome;
+
+// Aligned so that threads' histograms never share a cache line.
+typedef struct {
+  _Alignas(CACHE_LINE) uint64_t samples;
+  int64_t lo;
+  uint64_t span;
+  uint64_t* counts;
+  int outlierCount;
+  int outlierCapacity;
+  Outcome* outliers;
+} Histogram;
+
+void initHistogram(Histogram* histogram);
+void freeHistogram(Histogram* histogram);
+void addOutlier(Histogram* histogram, int value);
+void mergeHistogram(Histogram* to, const Histogram* from);
+
+static inline void addOutcome(Histogram* histogram, int value) {
+  // Values below lo wrap around to huge indices.
+  uint64_t index = (uint64_t)((int64_t)value - histogram->lo);
+  if (index < histogram->span) {
+    histogram->counts[index]++;
+  } else {
+    addOutlier(histogram, value);
+  }
+  histogram->samples++;
+}
+
+double histogramMean(const Histogram* histogram);
+double histogramVariance(const Histogram* histogram);
+
+// Half-width of the interval (at ±z) around the estimate count / samples
+// of a probability.
+double probabilityWidth(uint64_t count, uint64_t samples, double z);
+
+// z such that a standard normal variate lies within ±z with the given
+// probability, e.g. 2.576 for 0.99.
+double normalWidth(double confidence);
+
+// The widest half-interval (at ±z) around the mean and around the
+// probability of each outcome seen so far.
+double histogramPrecision(const Histogram* histogram, double z);
+
+// Roughly how many samples it'll take to get every half-interval down to
+// eps, going by the current estimates.
+uint64_t samplesNeeded(const Histogram* histogram, double z, double eps);
+
+// Every outcome seen, in increasing order of value. The caller frees them
+// with FREE_ARRAY(Outcome, outcomes, *count).
+Outcome* sortedOutcomes(const Histogram* histogram, int* count);
+
+// Probability table in increasing order of value, with the chance of
+// getting at least and at most each value like classic Troll, followed by
+// the mean and spread. With z > 0 each probability is followed by its
+// half-interval.
+void printHistogram(FILE* file, const Histogram* histogram, double z);
+
+#endif
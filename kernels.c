@@ -0,0 +1,777 @@
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+typedef int (*FilterKernel)(FilterOp op, int f, const void* src, int n, void* dst);
+typedef int (*ReduceKernel)(const void* src, int n);
+typedef int (*ExtremalKernel)(const void* src, int n, int* occurrences);
+
+// Each array is indexed by ElementWidth.
+typedef struct {
+  const char* name;
+  FilterKernel filter[3];
+  ReduceKernel sum[3];
+  ReduceKernel max[3];
+  ReduceKernel min[3];
+  ExtremalKernel maximal[3];
+  ExtremalKernel minimal[3];
+} Kernels;
+
+// Folds one (value, occurrences) pair into a running extreme.
+static void mergeExtreme(int* best, int* count, int value, int occurrences, bool max) {
+  if (occurrences == 0) { return; }
+  if (max ? value > *best : value < *best) {
+    *best = value;
+    *count = occurrences;
+  } else if (value == *best) {
+    *count += occurrences;
+  }
+}
+
+////////////////////////////////////////////////
+// Scalar
+////////////////////////////////////////////////
+
+#define SCALAR_FILTER(cmp)                      \
+  for (int i = 0; i < n; i++) {                 \
+    int e = src[i];                             \
+    dst[k] = src[i];                            \
+    k += (f cmp e);                             \
+  }
+
+// sum accumulates in unsigned int so that overflow wraps the same way the
+// vector versions do.
+#define DEFINE_SCALAR_KERNELS(T, bits)                                  \
+  static int filterScalar##bits(FilterOp op, int f, const void* source, \
+                                int n, void* destination) {             \
+    const T* src = source;                                              \
+    T* dst = destination;                                               \
+    int k = 0;                                                          \
+    switch (op) {                                                       \
+    case FILTER_EQ: SCALAR_FILTER(==); break;                           \
+    case FILTER_GE: SCALAR_FILTER(>=); break;                           \
+    case FILTER_GT: SCALAR_FILTER(>); break;                            \
+    case FILTER_LE: SCALAR_FILTER(<=); break;                           \
+    case FILTER_LT: SCALAR_FILTER(<); break;                            \
+    case FILTER_NEQ: SCALAR_FILTER(!=); break;                          \
+    }                                                                   \
+    return k;                                                           \
+  }                                                                     \
+                                                                        \
+  static int sumScalar##bits(const void* source, int n) {               \
+    const T* src = source;                                              \
+    unsigned int sum = 0;                                               \
+    for (int i = 0; i < n; i++) {                                       \
+      sum += (unsigned int)src[i];                                      \
+    }                                                                   \
+    return (int)sum;                                                    \
+  }                                                                     \
+                                                                        \
+  static int maxScalar##bits(const void* source, int n) {               \
+    const T* src = source;                                              \
+    int max = INT_MIN;                                                  \
+    for (int i = 0; i < n; i++) {                                       \
+      if (src[i] > max) { max = src[i]; }                               \
+    }                                                                   \
+    return max;                                                         \
+  }                                                                     \
+                                                                        \
+  static int minScalar##bits(const void* source, int n) {               \
+    const T* src = source;                                              \
+    int min = INT_MAX;                                                  \
+    for (int i = 0; i < n; i++) {                                       \
+      if (src[i] < min) { min = src[i]; }                               \
+    }                                                                   \
+    return min;                                                         \
+  }                                                                     \
+                                                                        \
+  static int maximalScalar##bits(const void* source, int n, int* occurrences) { \
+    const T* src = source;                                              \
+    int max = INT_MIN;                                                  \
+    int count = 0;                                                      \
+    for (int i = 0; i < n; i++) {                                       \
+      if (src[i] > max) {                                               \
+        max = src[i];                                                   \
+        count = 1;                                                      \
+      } else if (src[i] == max) {                                       \
+        count++;                                                        \
+      }                                                                 \
+    }                                                                   \
+    *occurrences = count;                                               \
+    return max;                                                         \
+  }                                                                     \
+                                                                        \
+  static int minimalScalar##bits(const void* source, int n, int* occurrences) { \
+    const T* src = source;                                              \
+    int min = INT_MAX;                                                  \
+    int count = 0;                                                      \
+    for (int i = 0; i < n; i++) {                                       \
+      if (src[i] < min) {                                               \
+        min = src[i];                                                   \
+        count = 1;                                                      \
+      } else if (src[i] == min) {                                       \
+        count++;                                                        \
+      }                                                                 \
+    }                                                                   \
+    *occurrences = count;                                               \
+    return min;                                                         \
+  }
+
+DEFINE_SCALAR_KERNELS(int8_t, 8)
+DEFINE_SCALAR_KERNELS(int16_t, 16)
+DEFINE_SCALAR_KERNELS(int32_t, 32)
+
+static const Kernels scalarKernels = {
+  "scalar",
+  { filterScalar8, filterScalar16, filterScalar32 },
+  { sumScalar8, sumScalar16, sumScalar32 },
+  { maxScalar8, maxScalar16, maxScalar32 },
+  { minScalar8, minScalar16, minScalar32 },
+  { maximalScalar8, maximalScalar16, maximalScalar32 },
+  { minimalScalar8, minimalScalar16, minimalScalar32 }
+};
+
+#ifdef KERNELS_X86
+
+// Filters compare every lane with f and then left-pack the selected lanes
+// to the front of the register using a shuffle looked up by the lane
+// mask. Whole registers (or 8-byte halves of them) are stored at dst + k;
+// since k never exceeds the number of elements read so far, a dst with
+// room for n elements is always large enough, and dst may be src.
+//
+// Every comparison is either 'a == b' or 'a > b', possibly negated:
+//   f == e  eq(e, f)     f != e  !eq(e, f)
+//   f <  e  gt(e, f)     f >= e  !gt(e, f)
+//   f >  e  gt(f, e)     f <= e  !gt(f, e)
+//
+// Reductions over 8 and 16 bit lanes accumulate into wider lanes, except
+// for minimal/maximal, which count repeats in narrow lanes for a block of
+// at most 255 (65535) vectors, so a lane count cannot wrap, and fold each
+// block into the running result before starting the next.
+
+static bool filterUsesEquality(FilterOp op) {
+  return op == FILTER_EQ || op == FILTER_NEQ;
+}
+
+static bool filterSwapsOperands(FilterOp op) {
+  return op == FILTER_GT || op == FILTER_LE;
+}
+
+static bool filterIsNegated(FilterOp op) {
+  return op == FILTER_NEQ || op == FILTER_GE || op == FILTER_LE;
+}
+
+static uint32_t leftPack8[256][8];     // 8 x 32 bit lanes: lane indices for vpermd
+static uint8_t leftPack4[16][16];      // 4 x 32 bit lanes: byte indices for pshufb
+static uint8_t leftPackWords[256][16]; // 8 x 16 bit lanes: byte indices for pshufb
+static uint64_t leftPackBytes[256];    // 8 x 8 bit lanes: byte indices for pshufb
+
+static void initLeftPackTables() {
+  for (int mask = 0; mask < 256; mask++) {
+    int k = 0;
+    uint8_t bytes[8];
+    memset(bytes, 0x80, sizeof(bytes));
+    memset(leftPackWords[mask], 0x80, sizeof(leftPackWords[mask]));
+    for (int lane = 0; lane < 8; lane++) {
+      if (mask & (1 << lane)) {
+        leftPack8[mask][k] = lane;
+        leftPackWords[mask][2 * k] = 2 * lane;
+        leftPackWords[mask][2 * k + 1] = 2 * lane + 1;
+        bytes[k] = lane;
+        k++;
+      }
+    }
+    for (int lane = k; lane < 8; lane++) { leftPack8[mask][lane] = 0; }
+    memcpy(&leftPackBytes[mask], bytes, sizeof(bytes));
+  }
+
+  for (int mask = 0; mask < 16; mask++) {
+    int k = 0;
+    for (int lane = 0; lane < 4; lane++) {
+      if (mask & (1 << lane)) {
+        for (int b = 0; b < 4; b++) { leftPack4[mask][4 * k + b] = 4 * lane + b; }
+        k++;
+      }
+    }
+    for (int b = 4 * k; b < 16; b++) { leftPack4[mask][b] = 0x80; }
+  }
+}
+
+////////////////////////////////////////////////
+// SSE4.1
+////////////////////////////////////////////////
+
+#define TARGET_SSE4 __attribute__((target("sse4.1,popcnt")))
+
+TARGET_SSE4
+static int horizontalMax4(__m128i v) {
+  v = _mm_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_max_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+TARGET_SSE4
+static int horizontalMin4(__m128i v) {
+  v = _mm_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_min_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+TARGET_SSE4
+static int horizontalSum4(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+TARGET_SSE4
+static int64_t horizontalSum2x64(__m128i v) {
+  return _mm_cvtsi128_si64(v) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+}
+
+// Left-packs the 16 bytes of e selected by bits into dst + k, 8 at a time.
+TARGET_SSE4
+static int packBytes(__m128i e, unsigned int bits, int8_t* dst, int k) {
+  unsigned int lo = bits & 0xff;
+  unsigned int hi = (bits >> 8) & 0xff;
+  __m128i shuffle = _mm_set_epi64x((long long)(leftPackBytes[hi] + 0x0808080808080808ull),
+                                   (long long)leftPackBytes[lo]);
+  __m128i packed = _mm_shuffle_epi8(e, shuffle);
+  _mm_storel_epi64((__m128i*)(dst + k), packed);
+  k += __builtin_popcount(lo);
+  _mm_storel_epi64((__m128i*)(dst + k), _mm_unpackhi_epi64(packed, packed));
+  return k + __builtin_popcount(hi);
+}
+
+// Left-packs the 8 words of e selected by bits into dst + k.
+TARGET_SSE4
+static int packWords(__m128i e, unsigned int bits, int16_t* dst, int k) {
+  __m128i shuffle = _mm_loadu_si128((const __m128i*)leftPackWords[bits & 0xff]);
+  _mm_storeu_si128((__m128i*)(dst + k), _mm_shuffle_epi8(e, shuffle));
+  return k + __builtin_popcount(bits & 0xff);
+}
+
+#define SSE4_FILTER_BODY(T, bits, lanes, pack)                                  \
+  const T* src = source;                                                        \
+  T* dst = destination;                                                         \
+  __m128i fv = _mm_set1_epi##bits(f);                                           \
+  unsigned int invert = filterIsNegated(op) ? 0xffffffffu : 0;                 \
+  int i = 0;                                                                    \
+  int k = 0;                                                                    \
+  if (filterUsesEquality(op)) {                                                 \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m128i e = _mm_loadu_si128((const __m128i*)(src + i));                   \
+      __m128i m = _mm_cmpeq_epi##bits(e, fv);                                   \
+      k = pack;                                                                 \
+    }                                                                           \
+  } else if (filterSwapsOperands(op)) {                                         \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m128i e = _mm_loadu_si128((const __m128i*)(src + i));                   \
+      __m128i m = _mm_cmpgt_epi##bits(fv, e);                                   \
+      k = pack;                                                                 \
+    }                                                                           \
+  } else {                                                                      \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m128i e = _mm_loadu_si128((const __m128i*)(src + i));                   \
+      __m128i m = _mm_cmpgt_epi##bits(e, fv);                                   \
+      k = pack;                                                                 \
+    }                                                                           \
+  }                                                                             \
+  return k + filterScalar##bits(op, f, src + i, n - i, dst + k);
+
+TARGET_SSE4
+static int packInts4(__m128i e, unsigned int bits, int32_t* dst, int k) {
+  __m128i shuffle = _mm_loadu_si128((const __m128i*)leftPack4[bits & 0xf]);
+  _mm_storeu_si128((__m128i*)(dst + k), _mm_shuffle_epi8(e, shuffle));
+  return k + __builtin_popcount(bits & 0xf);
+}
+
+TARGET_SSE4
+static int filterSse4_8(FilterOp op, int f, const void* source, int n, void* destination) {
+  SSE4_FILTER_BODY(int8_t, 8, 16,
+                   packBytes(e, _mm_movemask_epi8(m) ^ invert, dst, k))
+}
+
+TARGET_SSE4
+static int filterSse4_16(FilterOp op, int f, const void* source, int n, void* destination) {
+  SSE4_FILTER_BODY(int16_t, 16, 8,
+                   packWords(e, _mm_movemask_epi8(_mm_packs_epi16(m, m)) ^ invert, dst, k))
+}
+
+TARGET_SSE4
+static int filterSse4_32(FilterOp op, int f, const void* source, int n, void* destination) {
+  SSE4_FILTER_BODY(int32_t, 32, 4,
+                   packInts4(e, _mm_movemask_ps(_mm_castsi128_ps(m)) ^ invert, dst, k))
+}
+
+// Bias each byte to unsigned, add groups of 8 with psadbw, and take the
+// bias back off at the end.
+TARGET_SSE4
+static int sumSse4_8(const void* source, int n) {
+  const int8_t* src = source;
+  __m128i bias = _mm_set1_epi8((char)0x80);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i e = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), bias);
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(e, _mm_setzero_si128()));
+  }
+  uint64_t sum = (uint64_t)horizontalSum2x64(acc) - 128ull * (uint64_t)i;
+  return (int)((unsigned int)sum + (unsigned int)sumScalar8(src + i, n - i));
+}
+
+TARGET_SSE4
+static int sumSse4_16(const void* source, int n) {
+  const int16_t* src = source;
+  __m128i ones = _mm_set1_epi16(1);
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(src + i)), ones));
+  }
+  return (int)((unsigned int)horizontalSum4(acc) + (unsigned int)sumScalar16(src + i, n - i));
+}
+
+TARGET_SSE4
+static int sumSse4_32(const void* source, int n) {
+  const int32_t* src = source;
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)(src + i)));
+  }
+  return (int)((unsigned int)horizontalSum4(acc) + (unsigned int)sumScalar32(src + i, n - i));
+}
+
+// Narrow max/min: reduce in narrow lanes, then finish over the stored
+// lanes with the scalar kernel.
+#define SSE4_EXTREME(T, bits, lanes, op, init)                          \
+  const T* src = source;                                                \
+  __m128i acc = _mm_set1_epi##bits(init);                               \
+  int i = 0;                                                            \
+  for (; i + lanes <= n; i += lanes) {                                  \
+    acc = _mm_##op##_epi##bits(acc, _mm_loadu_si128((const __m128i*)(src + i))); \
+  }                                                                     \
+  T lane[lanes];                                                        \
+  _mm_storeu_si128((__m128i*)lane, acc);                                \
+  int best = op##Scalar##bits(lane, lanes);                             \
+  if (i == n) { return best; }                                          \
+  int tail = op##Scalar##bits(src + i, n - i);                          \
+  return (tail op##Better best) ? tail : best;
+
+#define maxBetter >
+#define minBetter <
+
+TARGET_SSE4
+static int maxSse4_8(const void* source, int n) {
+  SSE4_EXTREME(int8_t, 8, 16, max, INT8_MIN)
+}
+
+TARGET_SSE4
+static int maxSse4_16(const void* source, int n) {
+  SSE4_EXTREME(int16_t, 16, 8, max, INT16_MIN)
+}
+
+TARGET_SSE4
+static int minSse4_8(const void* source, int n) {
+  SSE4_EXTREME(int8_t, 8, 16, min, INT8_MAX)
+}
+
+TARGET_SSE4
+static int minSse4_16(const void* source, int n) {
+  SSE4_EXTREME(int16_t, 16, 8, min, INT16_MAX)
+}
+
+TARGET_SSE4
+static int maxSse4_32(const void* source, int n) {
+  const int32_t* src = source;
+  __m128i acc = _mm_set1_epi32(INT_MIN);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm_max_epi32(acc, _mm_loadu_si128((const __m128i*)(src + i)));
+  }
+  int max = horizontalMax4(acc);
+  int tail = maxScalar32(src + i, n - i);
+  return tail > max ? tail : max;
+}
+
+TARGET_SSE4
+static int minSse4_32(const void* source, int n) {
+  const int32_t* src = source;
+  __m128i acc = _mm_set1_epi32(INT_MAX);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm_min_epi32(acc, _mm_loadu_si128((const __m128i*)(src + i)));
+  }
+  int min = horizontalMin4(acc);
+  int tail = minScalar32(src + i, n - i);
+  return tail < min ? tail : min;
+}
+
+// Each lane tracks its own extreme value and how often it has seen it; a
+// new extreme resets the lane's count to 1, a repeat adds 1 (cmpeq yields
+// -1, so it is subtracted). better(a, b) is true where a beats b.
+#define SSE4_EXTREMAL(T, UT, bits, lanes, block, op, better, init, isMax) \
+  const T* src = source;                                                \
+  __m128i one = _mm_set1_epi##bits(1);                                  \
+  int best = isMax ? INT_MIN : INT_MAX;                                 \
+  int count = 0;                                                        \
+  int i = 0;                                                            \
+  while (i + lanes <= n) {                                              \
+    __m128i lane = _mm_set1_epi##bits(init);                            \
+    __m128i counts = _mm_setzero_si128();                               \
+    int end = (n - i) / lanes > block ? i + block * lanes : n;          \
+    for (; i + lanes <= end; i += lanes) {                              \
+      __m128i e = _mm_loadu_si128((const __m128i*)(src + i));           \
+      __m128i wins = better;                                            \
+      __m128i same = _mm_cmpeq_epi##bits(e, lane);                      \
+      counts = _mm_blendv_epi8(_mm_sub_epi##bits(counts, same), one, wins); \
+      lane = _mm_##op##_epi##bits(lane, e);                             \
+    }                                                                   \
+    T values[lanes];                                                    \
+    UT seen[lanes];                                                     \
+    _mm_storeu_si128((__m128i*)values, lane);                           \
+    _mm_storeu_si128((__m128i*)seen, counts);                           \
+    for (int l = 0; l < lanes; l++) {                                   \
+      mergeExtreme(&best, &count, values[l], seen[l], isMax);           \
+    }                                                                   \
+  }                                                                     \
+  int tailCount;                                                        \
+  int tail = op##imalScalar##bits(src + i, n - i, &tailCount);          \
+  mergeExtreme(&best, &count, tail, tailCount, isMax);                  \
+  *occurrences = count;                                                 \
+  return best;
+
+TARGET_SSE4
+static int maximalSse4_8(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int8_t, uint8_t, 8, 16, 255, max, _mm_cmpgt_epi8(e, lane), INT8_MIN, true)
+}
+
+TARGET_SSE4
+static int maximalSse4_16(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int16_t, uint16_t, 16, 8, 65535, max, _mm_cmpgt_epi16(e, lane), INT16_MIN, true)
+}
+
+TARGET_SSE4
+static int maximalSse4_32(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int32_t, uint32_t, 32, 4, INT_MAX / 4, max, _mm_cmpgt_epi32(e, lane), INT32_MIN, true)
+}
+
+TARGET_SSE4
+static int minimalSse4_8(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int8_t, uint8_t, 8, 16, 255, min, _mm_cmpgt_epi8(lane, e), INT8_MAX, false)
+}
+
+TARGET_SSE4
+static int minimalSse4_16(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int16_t, uint16_t, 16, 8, 65535, min, _mm_cmpgt_epi16(lane, e), INT16_MAX, false)
+}
+
+TARGET_SSE4
+static int minimalSse4_32(const void* source, int n, int* occurrences) {
+  SSE4_EXTREMAL(int32_t, uint32_t, 32, 4, INT_MAX / 4, min, _mm_cmpgt_epi32(lane, e), INT32_MAX, false)
+}
+
+static const Kernels sse4Kernels = {
+  "sse4.1",
+  { filterSse4_8, filterSse4_16, filterSse4_32 },
+  { sumSse4_8, sumSse4_16, sumSse4_32 },
+  { maxSse4_8, maxSse4_16, maxSse4_32 },
+  { minSse4_8, minSse4_16, minSse4_32 },
+  { maximalSse4_8, maximalSse4_16, maximalSse4_32 },
+  { minimalSse4_8, minimalSse4_16, minimalSse4_32 }
+};
+
+////////////////////////////////////////////////
+// AVX2
+////////////////////////////////////////////////
+
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+
+TARGET_AVX2
+static int horizontalSum8(__m256i v) {
+  return horizontalSum4(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+TARGET_AVX2
+static int packInts8(__m256i e, unsigned int bits, int32_t* dst, int k) {
+  __m256i perm = _mm256_loadu_si256((const __m256i*)leftPack8[bits & 0xff]);
+  _mm256_storeu_si256((__m256i*)(dst + k), _mm256_permutevar8x32_epi32(e, perm));
+  return k + __builtin_popcount(bits & 0xff);
+}
+
+TARGET_AVX2
+static int packBytes32(__m256i e, unsigned int bits, int8_t* dst, int k) {
+  k = packBytes(_mm256_castsi256_si128(e), bits & 0xffff, dst, k);
+  return packBytes(_mm256_extracti128_si256(e, 1), bits >> 16, dst, k);
+}
+
+// packs_epi16 works within 128-bit halves, so lanes 0-7 of the mask land
+// in bits 0-7 and lanes 8-15 in bits 16-23.
+TARGET_AVX2
+static int packWords16(__m256i e, unsigned int bits, int16_t* dst, int k) {
+  k = packWords(_mm256_castsi256_si128(e), bits, dst, k);
+  return packWords(_mm256_extracti128_si256(e, 1), bits >> 16, dst, k);
+}
+
+#define AVX2_FILTER_BODY(T, bits, lanes, pack)                                  \
+  const T* src = source;                                                        \
+  T* dst = destination;                                                         \
+  __m256i fv = _mm256_set1_epi##bits(f);                                        \
+  unsigned int invert = filterIsNegated(op) ? 0xffffffffu : 0;                 \
+  int i = 0;                                                                    \
+  int k = 0;                                                                    \
+  if (filterUsesEquality(op)) {                                                 \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m256i e = _mm256_loadu_si256((const __m256i*)(src + i));                \
+      __m256i m = _mm256_cmpeq_epi##bits(e, fv);                                \
+      k = pack;                                                                 \
+    }                                                                           \
+  } else if (filterSwapsOperands(op)) {                                         \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m256i e = _mm256_loadu_si256((const __m256i*)(src + i));                \
+      __m256i m = _mm256_cmpgt_epi##bits(fv, e);                                \
+      k = pack;                                                                 \
+    }                                                                           \
+  } else {                                                                      \
+    for (; i + lanes <= n; i += lanes) {                                        \
+      __m256i e = _mm256_loadu_si256((const __m256i*)(src + i));                \
+      __m256i m = _mm256_cmpgt_epi##bits(e, fv);                                \
+      k = pack;                                                                 \
+    }                                                                           \
+  }                                                                             \
+  return k + filterScalar##bits(op, f, src + i, n - i, dst + k);
+
+TARGET_AVX2
+static int filterAvx2_8(FilterOp op, int f, const void* source, int n, void* destination) {
+  AVX2_FILTER_BODY(int8_t, 8, 32,
+                   packBytes32(e, (unsigned int)_mm256_movemask_epi8(m) ^ invert, dst, k))
+}
+
+TARGET_AVX2
+static int filterAvx2_16(FilterOp op, int f, const void* source, int n, void* destination) {
+  AVX2_FILTER_BODY(int16_t, 16, 16,
+                   packWords16(e, (unsigned int)_mm256_movemask_epi8(_mm256_packs_epi16(m, m)) ^ invert,
+                               dst, k))
+}
+
+TARGET_AVX2
+static int filterAvx2_32(FilterOp op, int f, const void* source, int n, void* destination) {
+  AVX2_FILTER_BODY(int32_t, 32, 8,
+                   packInts8(e, (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(m)) ^ invert, dst, k))
+}
+
+TARGET_AVX2
+static int sumAvx2_8(const void* source, int n) {
+  const int8_t* src = source;
+  __m256i bias = _mm256_set1_epi8((char)0x80);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i e = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + i)), bias);
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(e, _mm256_setzero_si256()));
+  }
+  __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  uint64_t sum = (uint64_t)horizontalSum2x64(half) - 128ull * (uint64_t)i;
+  return (int)((unsigned int)sum + (unsigned int)sumScalar8(src + i, n - i));
+}
+
+TARGET_AVX2
+static int sumAvx2_16(const void* source, int n) {
+  const int16_t* src = source;
+  __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(src + i)), ones));
+  }
+  return (int)((unsigned int)horizontalSum8(acc) + (unsigned int)sumScalar16(src + i, n - i));
+}
+
+TARGET_AVX2
+static int sumAvx2_32(const void* source, int n) {
+  const int32_t* src = source;
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i*)(src + i)));
+  }
+  return (int)((unsigned int)horizontalSum8(acc) + (unsigned int)sumScalar32(src + i, n - i));
+}
+
+#define AVX2_EXTREME(T, bits, lanes, op, init)                          \
+  const T* src = source;                                                \
+  __m256i acc = _mm256_set1_epi##bits(init);                            \
+  int i = 0;                                                            \
+  for (; i + lanes <= n; i += lanes) {                                  \
+    acc = _mm256_##op##_epi##bits(acc, _mm256_loadu_si256((const __m256i*)(src + i))); \
+  }                                                                     \
+  T lane[lanes];                                                        \
+  _mm256_storeu_si256((__m256i*)lane, acc);                             \
+  int best = op##Scalar##bits(lane, lanes);                             \
+  if (i == n) { return best; }                                          \
+  int tail = op##Scalar##bits(src + i, n - i);                          \
+  return (tail op##Better best) ? tail : best;
+
+TARGET_AVX2
+static int maxAvx2_8(const void* source, int n) {
+  AVX2_EXTREME(int8_t, 8, 32, max, INT8_MIN)
+}
+
+TARGET_AVX2
+static int maxAvx2_16(const void* source, int n) {
+  AVX2_EXTREME(int16_t, 16, 16, max, INT16_MIN)
+}
+
+TARGET_AVX2
+static int maxAvx2_32(const void* source, int n) {
+  AVX2_EXTREME(int32_t, 32, 8, max, INT32_MIN)
+}
+
+TARGET_AVX2
+static int minAvx2_8(const void* source, int n) {
+  AVX2_EXTREME(int8_t, 8, 32, min, INT8_MAX)
+}
+
+TARGET_AVX2
+static int minAvx2_16(const void* source, int n) {
+  AVX2_EXTREME(int16_t, 16, 16, min, INT16_MAX)
+}
+
+TARGET_AVX2
+static int minAvx2_32(const void* source, int n) {
+  AVX2_EXTREME(int32_t, 32, 8, min, INT32_MAX)
+}
+
+#define AVX2_EXTREMAL(T, UT, bits, lanes, block, op, better, init, isMax) \
+  const T* src = source;                                                \
+  __m256i one = _mm256_set1_epi##bits(1);                               \
+  int best = isMax ? INT_MIN : INT_MAX;                                 \
+  int count = 0;                                                        \
+  int i = 0;                                                            \
+  while (i + lanes <= n) {                                              \
+    __m256i lane = _mm256_set1_epi##bits(init);                         \
+    __m256i counts = _mm256_setzero_si256();                            \
+    int end = (n - i) / lanes > block ? i + block * lanes : n;          \
+    for (; i + lanes <= end; i += lanes) {                              \
+      __m256i e = _mm256_loadu_si256((const __m256i*)(src + i));        \
+      __m256i wins = better;                                            \
+      __m256i same = _mm256_cmpeq_epi##bits(e, lane);                   \
+      counts = _mm256_blendv_epi8(_mm256_sub_epi##bits(counts, same), one, wins); \
+      lane = _mm256_##op##_epi##bits(lane, e);                          \
+    }                                                                   \
+    T values[lanes];                                                    \
+    UT seen[lanes];                                                     \
+    _mm256_storeu_si256((__m256i*)values, lane);                        \
+    _mm256_storeu_si256((__m256i*)seen, counts);                        \
+    for (int l = 0; l < lanes; l++) {                                   \
+      mergeExtreme(&best, &count, values[l], seen[l], isMax);           \
+    }                                                                   \
+  }                                                                     \
+  int tailCount;                                                        \
+  int tail = op##imalScalar##bits(src + i, n - i, &tailCount);          \
+  mergeExtreme(&best, &count, tail, tailCount, isMax);                  \
+  *occurrences = count;                                                 \
+  return best;
+
+TARGET_AVX2
+static int maximalAvx2_8(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int8_t, uint8_t, 8, 32, 255, max, _mm256_cmpgt_epi8(e, lane), INT8_MIN, true)
+}
+
+TARGET_AVX2
+static int maximalAvx2_16(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int16_t, uint16_t, 16, 16, 65535, max, _mm256_cmpgt_epi16(e, lane), INT16_MIN, true)
+}
+
+TARGET_AVX2
+static int maximalAvx2_32(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int32_t, uint32_t, 32, 8, INT_MAX / 8, max, _mm256_cmpgt_epi32(e, lane), INT32_MIN, true)
+}
+
+TARGET_AVX2
+static int minimalAvx2_8(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int8_t, uint8_t, 8, 32, 255, min, _mm256_cmpgt_epi8(lane, e), INT8_MAX, false)
+}
+
+TARGET_AVX2
+static int minimalAvx2_16(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int16_t, uint16_t, 16, 16, 65535, min, _mm256_cmpgt_epi16(lane, e), INT16_MAX, false)
+}
+
+TARGET_AVX2
+static int minimalAvx2_32(const void* source, int n, int* occurrences) {
+  AVX2_EXTREMAL(int32_t, uint32_t, 32, 8, INT_MAX / 8, min, _mm256_cmpgt_epi32(lane, e), INT32_MAX, false)
+}
+
+static const Kernels avx2Kernels = {
+  "avx2",
+  { filterAvx2_8, filterAvx2_16, filterAvx2_32 },
+  { sumAvx2_8, sumAvx2_16, sumAvx2_32 },
+  { maxAvx2_8, maxAvx2_16, maxAvx2_32 },
+  { minAvx2_8, minAvx2_16, minAvx2_32 },
+  { maximalAvx2_8, maximalAvx2_16, maximalAvx2_32 },
+  { minimalAvx2_8, minimalAvx2_16, minimalAvx2_32 }
+};
+
+#endif
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+static const Kernels* kernels = &scalarKernels;
+
+static void selectKernels() {
+#ifdef KERNELS_X86
+  initLeftPackTables();
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    kernels = &avx2Kernels;
+  } else if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt")) {
+    kernels = &sse4Kernels;
+  }
+#endif
+}
+
+// Safe to call from every thread that starts a VM.
+void initKernels() {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, selectKernels);
+}
+
+int filterElements(FilterOp op, int f, ElementWidth width, const void* src, int n, void* dst) {
+  if (!fitsWidth(f, width)) {
+    // f lies beyond every element, so it compares the same way with each.
+    if (!filterAccepts(op, f, 0)) { return 0; }
+    memmove(dst, src, (size_t)n * elementSize(width));
+    return n;
+  }
+  return kernels->filter[width](op, f, src, n, dst);
+}
+
+int sumElements(ElementWidth width, const void* src, int n) {
+  return kernels->sum[width](src, n);
+}
+
+int maxElements(ElementWidth width, const void* src, int n) {
+  return kernels->max[width](src, n);
+}
+
+int minElements(ElementWidth width, const void* src, int n) {
+  return kernels->min[width](src, n);
+}
+
+int maximalElements(ElementWidth width, const void* src, int n, int* occurrences) {
+  return kernels->maximal[width](src, n, occurrences);
+}
+
+int minimalElements(ElementWidth width, const void* src, int n, int* occurrences) {
+  return kernels->minimal[width](src, n, occurrences);
+}
@@ -0,0 +1,82 @@
+#ifndef tvm_kernels_h
+#define tvm_kernels_h
+
+#include "common.h"
+
+// Inner loops over collection elements. Each kernel has a scalar version
+// and, on x86, SSE4.1 and AVX2 versions; initKernels() picks the best
+// one the CPU supports. Elements are 8, 16 or 32 bit signed integers and
+// every kernel has a specialized path for each width.
+
+typedef enum {
+  WIDTH_8,
+  WIDTH_16,
+  WIDTH_32
+} ElementWidth;
+
+typedef enum {
+  FILTER_EQ,
+  FILTER_GE,
+  FILTER_GT,
+  FILTER_LE,
+  FILTER_LT,
+  FILTER_NEQ
+} FilterOp;
+
+void initKernels(void);
+
+static inline int elementSize(ElementWidth width) {
+  return 1 << width;
+}
+
+static inline bool fitsWidth(int n, ElementWidth width) {
+  switch (width) {
+  case WIDTH_8: return n >= INT8_MIN && n <= INT8_MAX;
+  case WIDTH_16: return n >= INT16_MIN && n <= INT16_MAX;
+  case WIDTH_32: return true;
+  }
+  return true;
+}
+
+// The narrowest width that can hold n.
+static inline ElementWidth widthFor(int n) {
+  if (fitsWidth(n, WIDTH_8)) { return WIDTH_8; }
+  if (fitsWidth(n, WIDTH_16)) { return WIDTH_16; }
+  return WIDTH_32;
+}
+
+// The narrowest width that can hold every value in [lo, hi].
+static inline ElementWidth widthForRange(int lo, int hi) {
+  ElementWidth width = widthFor(lo);
+  return widthFor(hi) > width ? widthFor(hi) : width;
+}
+
+static inline bool filterAccepts(FilterOp op, int f, int e) {
+  switch (op) {
+  case FILTER_EQ: return f == e;
+  case FILTER_GE: return f >= e;
+  case FILTER_GT: return f > e;
+  case FILTER_LE: return f <= e;
+  case FILTER_LT: return f < e;
+  case FILTER_NEQ: return f != e;
+  }
+  return false;
+}
+
+// Copies every element e of src for which 'f op e' holds into dst (which
+// must have room for n elements of the same width, or be src itself) and
+// returns how many were copied.
+int filterElements(FilterOp op, int f, ElementWidth width, const void* src, int n, void* dst);
+
+int sumElements(ElementWidth width, const void* src, int n);
+
+// n must be positive.
+int maxElements(ElementWidth width, const void* src, int n);
+int minElements(ElementWidth width, const void* src, int n);
+
+// Largest (smallest) element and, in one pass, how often it occurs.
+// When n is 0, *occurrences is set to 0.
+int maximalElements(ElementWidth width, const void* src, int n, int* occurrences);
+int minimalElements(ElementWidth width, const void* src, int n, int* occurrences);
+
+#endif
@@ -1,7 +1,22 @@
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "memory.h"
 
+_Thread_local jmp_buf* outOfMemory = NULL;
+
+void* allocateAligned(size_t alignment, size_t size) {
+  void* result = aligned_alloc(alignment, size);
+  if (result == NULL) { failAllocation(); }
+  return result;
+}
+
+void failAllocation() {
+  if (outOfMemory != NULL) { longjmp(*outOfMemory, 1); }
+  fprintf(stderr, "Out of memory.\n");
+  abort();
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   if (newSize == 0) {
     free(pointer);
@@ -9,8 +24,6 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   }
 
   void* result = realloc(pointer, newSize);
-  if (result == NULL) { exit(1); }
+  if (result == NULL) { failAllocation(); }
   return result;
 }
-
-     
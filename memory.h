@@ -1,6 +1,8 @@
 #ifndef tvm_memory_h
 #define tvm_memory_h
 
+#include <setjmp.h>
+
 #include "common.h"
 
 #define ALLOCATE(type, count) \
@@ -9,12 +11,25 @@
 #define GROW_CAPACITY(capacity) \
   ((capacity) < 8 ? 8 : (capacity) * 2)
 
+#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
   (type *)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 
+// When an allocation fails, reallocate jumps here if the calling thread
+// has set it (as every libtroll entry point does), and aborts otherwise.
+extern _Thread_local jmp_buf* outOfMemory;
+
+// What reallocate does when an allocation fails, for memory that comes
+// from elsewhere.
+void failAllocation(void);
+
+// Fails like reallocate. size must be a multiple of alignment, and the
+// memory is freed with free.
+void* allocateAligned(size_t alignment, size_t size);
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
 #endif
@@ -0,0 +1,362 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "kernels.h"
+#include "memory.h"
+#include "multiset.h"
+#include "object.h"
+
+#define MULTISETS_MAX_LOAD 0.5
+
+// Steps through a key's distinct values in increasing order.
+typedef struct {
+  const Multiset* key;
+  const uint8_t* bytes;
+  int index;
+} Cursor;
+
+// Steps through a sorted collection's distinct values.
+typedef struct {
+  const ObjCollection* c;
+  int index;
+} Runs;
+
+static void adjustCapacity(MultisetTable* table, int capacity);
+static Multiset* findMultiset(Multiset* multisets, int capacity, const uint8_t* arena,
+                              const Multiset* key);
+static uint64_t hashKey(const Multiset* key, const uint8_t* bytes);
+static void insertKey(MultisetTable* table, const Multiset* key, uint64_t count);
+static size_t keySize(const Multiset* key);
+static bool nextKeyRun(Cursor* cursor, int* value, int* count);
+static bool nextRun(Runs* runs, int* value, int* count);
+static void reserveKey(MultisetTable* table, Multiset* key);
+
+void addMultiset(MultisetTable* table, ObjCollection* c) {
+  if (c->kind == COLLECTION_LIST) {
+    sortCollection(c);
+  }
+
+  // One pass for the shape of the multiset, so the key's form and width
+  // only depend on its value...
+  int value;
+  int count;
+  int lo = 0;
+  int hi = 0;
+  int longest = 0;
+  Runs runs = { c, 0 };
+  for (bool first = true; nextRun(&runs, &value, &count); first = false) {
+    if (first) { lo = value; }
+    hi = value;
+    if (count > longest) { longest = count; }
+  }
+
+  Multiset key;
+  key.lo = lo;
+  key.form = KEY_SORTED;
+  key.length = c->count;
+  key.width = widthForRange(lo, hi);
+  int64_t bins = (int64_t)hi - lo + 1;
+  ElementWidth countWidth = widthFor(longest);
+  if (c->count > 0 && bins * elementSize(countWidth) < (int64_t)c->count * elementSize(key.width)) {
+    key.form = KEY_COUNTS;
+    key.length = (int)bins;
+    key.width = countWidth;
+  }
+
+  // ...and another to write it at the end of the arena. It stays there
+  // only if it's new.
+  reserveKey(table, &key);
+  uint8_t* bytes = table->arena + key.offset;
+  runs.index = 0;
+  int next = 0;
+  while (nextRun(&runs, &value, &count)) {
+    if (key.form == KEY_SORTED) {
+      for (int i = 0; i < count; i++) {
+        storeElement(bytes, key.width, next++, value);
+      }
+    } else {
+      for (; lo + next < value; next++) {
+        storeElement(bytes, key.width, next, 0);
+      }
+      storeElement(bytes, key.width, next++, count);
+    }
+  }
+
+  key.hash = hashKey(&key, bytes);
+  insertKey(table, &key, 1);
+  table->samples++;
+}
+
+static void adjustCapacity(MultisetTable* table, int capacity) {
+  Multiset* multisets = ALLOCATE(Multiset, capacity);
+  for (int i = 0; i < capacity; i++) {
+    multisets[i].count = 0;
+  }
+
+  for (int i = 0; i < table->capacity; i++) {
+    Multiset* multiset = &table->multisets[i];
+    if (multiset->count != 0) {
+      *findMultiset(multisets, capacity, table->arena, multiset) = *multiset;
+    }
+  }
+
+  FREE_ARRAY(Multiset, table->multisets, table->capacity);
+  table->multisets = multisets;
+  table->capacity = capacity;
+}
+
+// Lexicographic order of the elements, for printing. qsort doesn't pass
+// the arena along, so it goes through sortArena.
+static const uint8_t* sortArena;
+
+static int compareMultisets(const void* a, const void* b) {
+  const Multiset* x = *(const Multiset* const*)a;
+  const Multiset* y = *(const Multiset* const*)b;
+  Cursor cx = { x, sortArena + x->offset, 0 };
+  Cursor cy = { y, sortArena + y->offset, 0 };
+
+  // A run at a time: after equal runs both go on with the same element.
+  for (;;) {
+    int vx, vy, nx, ny;
+    bool more = nextKeyRun(&cx, &vx, &nx);
+    if (more != nextKeyRun(&cy, &vy, &ny)) { return more ? 1 : -1; }
+    if (!more) { return 0; }
+    if (vx != vy) { return vx < vy ? -1 : 1; }
+    if (nx != ny) {
+      // The shorter run is followed by something bigger than vx, unless
+      // it's the end of its multiset.
+      Cursor* shorter = nx < ny ? &cx : &cy;
+      int v, n;
+      bool shorterGoesOn = nextKeyRun(shorter, &v, &n);
+      return (shorter == &cx) == shorterGoesOn ? 1 : -1;
+    }
+  }
+}
+
+// capacity is a power of two.
+static Multiset* findMultiset(Multiset* multisets, int capacity, const uint8_t* arena,
+                              const Multiset* key) {
+  uint32_t index = (uint32_t)key->hash & (capacity - 1);
+
+  for (;;) {
+    Multiset* multiset = &multisets[index];
+    if (multiset->count == 0) {
+      return multiset;
+    }
+    if (multiset->hash == key->hash && multiset->form == key->form &&
+        multiset->width == key->width && multiset->length == key->length &&
+        multiset->lo == key->lo &&
+        memcmp(arena + multiset->offset, arena + key->offset, keySize(key)) == 0) {
+      return multiset;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+void freeMultisets(MultisetTable* table) {
+  FREE_ARRAY(Multiset, table->multisets, table->capacity);
+  FREE_ARRAY(uint8_t, table->arena, table->arenaCapacity);
+  initMultisets(table);
+}
+
+// Multiply-xorshift over 8 bytes at a time, with the splitmix64 finalizer.
+static uint64_t hashKey(const Multiset* key, const uint8_t* bytes) {
+  uint64_t hash = ((uint64_t)key->form << 40 | (uint64_t)key->width << 32 | (uint32_t)key->lo);
+  hash = (hash * 0x9e3779b97f4a7c15) ^ (uint32_t)key->length;
+
+  size_t size = keySize(key);
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, bytes + i, size - i < 8 ? size - i : 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+    hash ^= hash >> 32;
+  }
+
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+void initMultisets(MultisetTable* table) {
+  table->samples = 0;
+  table->count = 0;
+  table->capacity = 0;
+  table->multisets = NULL;
+  table->arenaSize = 0;
+  table->arenaCapacity = 0;
+  table->arena = NULL;
+}
+
+// The key's bytes are at key->offset, at the end of the arena. A new key
+// keeps them there; otherwise they're dropped.
+static void insertKey(MultisetTable* table, const Multiset* key, uint64_t count) {
+  if (table->count + 1 > table->capacity * MULTISETS_MAX_LOAD) {
+    adjustCapacity(table, GROW_CAPACITY(table->capacity));
+  }
+
+  Multiset* multiset = findMultiset(table->multisets, table->capacity, table->arena, key);
+  if (multiset->count == 0) {
+    *multiset = *key;
+    multiset->count = count;
+    table->count++;
+    table->arenaSize = key->offset + keySize(key);
+  } else {
+    multiset->count += count;
+  }
+}
+
+static size_t keySize(const Multiset* key) {
+  return (size_t)key->length * elementSize(key->width);
+}
+
+void mergeMultisets(MultisetTable* to, const MultisetTable* from) {
+  for (int i = 0; i < from->capacity; i++) {
+    const Multiset* multiset = &from->multisets[i];
+    if (multiset->count != 0) {
+      Multiset key = *multiset;
+      reserveKey(to, &key);
+      memcpy(to->arena + key.offset, from->arena + multiset->offset, keySize(&key));
+      insertKey(to, &key, multiset->count);
+    }
+  }
+  to->samples += from->samples;
+}
+
+double multisetPrecision(const MultisetTable* table, double z) {
+  double widest = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    const Multiset* multiset = &table->multisets[i];
+    if (multiset->count != 0) {
+      double width = probabilityWidth(multiset->count, table->samples, z);
+      if (width > widest) { widest = width; }
+    }
+  }
+  return widest;
+}
+
+uint64_t multisetSamplesNeeded(const MultisetTable* table, double z, double eps) {
+  double spread = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    const Multiset* multiset = &table->multisets[i];
+    if (multiset->count != 0) {
+      double p = (double)multiset->count / table->samples;
+      if (p * (1 - p) > spread) { spread = p * (1 - p); }
+    }
+  }
+
+  double needed = ceil(z * z * spread / (eps * eps));
+  return needed >= (double)UINT64_MAX ? UINT64_MAX : (uint64_t)needed;
+}
+
+static bool nextKeyRun(Cursor* cursor, int* value, int* count) {
+  const Multiset* key = cursor->key;
+  if (key->form == KEY_SORTED) {
+    if (cursor->index >= key->length) { return false; }
+    *value = loadElement(cursor->bytes, key->width, cursor->index);
+    int end = cursor->index + 1;
+    while (end < key->length && loadElement(cursor->bytes, key->width, end) == *value) {
+      end++;
+    }
+    *count = end - cursor->index;
+    cursor->index = end;
+    return true;
+  }
+
+  while (cursor->index < key->length && loadElement(cursor->bytes, key->width, cursor->index) == 0) {
+    cursor->index++;
+  }
+  if (cursor->index >= key->length) { return false; }
+  *value = key->lo + cursor->index;
+  *count = loadElement(cursor->bytes, key->width, cursor->index++);
+  return true;
+}
+
+// Sets *value to the next distinct value of a sorted list, a counted
+// collection or a range, and *count to how many times it occurs.
+static bool nextRun(Runs* runs, int* value, int* count) {
+  const ObjCollection* c = runs->c;
+  switch (c->kind) {
+  case COLLECTION_LIST: {
+    if (runs->index >= c->count) { return false; }
+    *value = elementAt(c, runs->index);
+    int end = runs->index + 1;
+    while (end < c->count && elementAt(c, end) == *value) {
+      end++;
+    }
+    *count = end - runs->index;
+    runs->index = end;
+    return true;
+  }
+  case COLLECTION_COUNTS:
+    while (runs->index < c->span && c->counts[runs->index] == 0) {
+      runs->index++;
+    }
+    if (runs->index >= c->span) { return false; }
+    *value = c->lo + runs->index;
+    *count = c->counts[runs->index++];
+    return true;
+  case COLLECTION_RANGE:
+    if (runs->index >= c->count) { return false; }
+    *value = c->lo + runs->index++;
+    *count = 1;
+    return true;
+  }
+  return false;
+}
+
+void printMultisets(FILE* file, const MultisetTable* table, double z) {
+  const Multiset** sorted = ALLOCATE(const Multiset*, table->count);
+  int n = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->multisets[i].count != 0) {
+      sorted[n++] = &table->multisets[i];
+    }
+  }
+  sortArena = table->arena;
+  qsort(sorted, n, sizeof(const Multiset*), compareMultisets);
+
+  fprintf(file, z > 0 ? "%-19s  %s\n" : "%-8s  %s\n", "=", "Outcome");
+  for (int i = 0; i < n; i++) {
+    const Multiset* multiset = sorted[i];
+    fprintf(file, "%.6f", (double)multiset->count / table->samples);
+    if (z > 0) {
+      fprintf(file, " ± %.6f", probabilityWidth(multiset->count, table->samples, z));
+    }
+    fprintf(file, " ");
+
+    Cursor cursor = { multiset, table->arena + multiset->offset, 0 };
+    int value;
+    int count;
+    for (bool first = true; nextKeyRun(&cursor, &value, &count); ) {
+      for (int j = 0; j < count; j++, first = false) {
+        fprintf(file, first ? " %d" : ", %d", value);
+      }
+    }
+    fputc('\n', file);
+  }
+  FREE_ARRAY(const Multiset*, sorted, table->count);
+
+  fprintf(file, "Distinct outcomes = %d\n", table->count);
+  fprintf(file, "Samples = %llu\n", (unsigned long long)table->samples);
+}
+
+// Makes room for the key at the end of the arena, aligned for its width,
+// and sets its offset.
+static void reserveKey(MultisetTable* table, Multiset* key) {
+  size_t align = elementSize(key->width);
+  size_t offset = (table->arenaSize + align - 1) & ~(align - 1);
+  size_t end = offset + keySize(key);
+  if (end > table->arenaCapacity) {
+    size_t capacity = GROW_CAPACITY(table->arenaCapacity);
+    while (capacity < end) {
+      capacity *= 2;
+    }
+    table->arena = GROW_ARRAY(uint8_t, table->arena, table->arenaCapacity, capacity);
+    table->arenaCapacity = capacity;
+  }
+  key->offset = offset;
+}
@@ -0,0 +1,59 @@
+#ifndef tvm_multiset_h
+#define tvm_multiset_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+// How often each collection-valued result came up, as multisets: the
+// order elements were rolled in doesn't matter. Each collection is
+// reduced to a canonical key, either its sorted elements or, when that's
+// shorter, how many times each value from its smallest to its largest
+// occurs. Keys are stored in the narrowest width that holds them, one
+// after another in an arena, and found through an open-addressing table
+// of their hashes. Every sampling thread fills its own table and they're
+// merged at the end of each batch.
+
+typedef enum {
+  KEY_SORTED, // length elements in increasing order
+  KEY_COUNTS  // length counts, of lo, lo + 1, ...
+} KeyForm;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t count; // 0 marks an empty slot
+  size_t offset; // of the key in the arena
+  int length;
+  int lo;
+  uint8_t form;
+  uint8_t width;
+} Multiset;
+
+// Aligned so that threads' tables never share a cache line.
+typedef struct {
+  _Alignas(CACHE_LINE) uint64_t samples;
+  int count;
+  int capacity;
+  Multiset* multisets;
+  size_t arenaSize;
+  size_t arenaCapacity;
+  uint8_t* arena;
+} MultisetTable;
+
+void initMultisets(MultisetTable* table);
+void freeMultisets(MultisetTable* table);
+
+// Sorts c in place, which doesn't change its value.
+void addMultiset(MultisetTable* table, ObjCollection* c);
+void mergeMultisets(MultisetTable* to, const MultisetTable* from);
+
+// Like the histogram functions of the same names.
+double multisetPrecision(const MultisetTable* table, double z);
+uint64_t multisetSamplesNeeded(const MultisetTable* table, double z, double eps);
+
+// Probability of each multiset, in lexicographic order; with z > 0 each
+// is followed by its half-interval.
+void printMultisets(FILE* file, const MultisetTable* table, double z);
+
+#endif
@@ -10,20 +10,53 @@
 #define ALLOCATE_OBJ(type, objectType) \
   (type*)allocateObject(sizeof(type), objectType)
 
+// Every object the calling thread has allocated, newest first.
+static _Thread_local Obj* objects = NULL;
+
+// Converts the elements in place, back to front, so that no element is
+// overwritten before it has been read.
+static void widenCollection(ObjCollection* c, ElementWidth width) {
+  ElementWidth oldWidth = c->width;
+  c->elements = reallocate(c->elements, (size_t)c->capacity * elementSize(oldWidth),
+                           (size_t)c->capacity * elementSize(width));
+  for (int i = c->count - 1; i >= 0; i--) {
+    storeElement(c->elements, width, i, loadElement(c->elements, oldWidth, i));
+  }
+  c->width = width;
+}
+
 void addToCollection(ObjCollection* c, int n) {
+  if (IS_COUNTED(c)) {
+    if (n >= c->lo && n - c->lo < c->span) {
+      c->counts[n - c->lo]++;
+      c->count++;
+      return;
+    }
+    flattenCollection(c);
+  } else if (IS_RANGE(c)) {
+    flattenCollection(c);
+  }
+
+  if (!fitsWidth(n, c->width)) {
+    widenCollection(c, widthFor(n));
+  }
+
   if (c->capacity < c->count + 1) {
     int oldCapacity = c->capacity;
+    size_t size = elementSize(c->width);
     c->capacity = GROW_CAPACITY(oldCapacity);
-    c->ints = GROW_ARRAY(int, c->ints, oldCapacity, c->capacity);
+    c->elements = reallocate(c->elements, oldCapacity * size, c->capacity * size);
   }
 
-  c->ints[c->count] = n;
+  storeElement(c->elements, c->width, c->count, n);
   c->count++;
 }
 
 static Obj* allocateObject(size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
+  object->next = objects;
+  objects = object;
   return object;
 }
 
@@ -44,30 +77,79 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
   return string;
 }
 
+// The index-th smallest element of a counted collection.
+int countedElementAt(const ObjCollection* c, int index) {
+  for (int i = 0; i < c->span; i++) {
+    if (index < c->counts[i]) {
+      return c->lo + i;
+    }
+    index -= c->counts[i];
+  }
+
+  return c->lo + c->span - 1;
+}
+
 ObjCollection* copyCollection(const ObjCollection* c) {
-  ObjCollection* r = initCollection();
-  r->capacity = c->capacity;
+  if (IS_COUNTED(c)) {
+    ObjCollection* r = initCountedCollection(c->lo, c->lo + c->span - 1);
+    memcpy(r->counts, c->counts, c->span * sizeof(int));
+    r->count = c->count;
+    return r;
+  }
+  if (IS_RANGE(c)) {
+    return initRangeCollection(c->lo, c->lo + c->count - 1);
+  }
+
+  ObjCollection* r = initSizedCollection(c->count, c->width);
+  memcpy(r->elements, c->elements, (size_t)c->count * elementSize(c->width));
   r->count = c->count;
-  size_t size = c->capacity * sizeof(int);
-  
-  int* ints = (int*)reallocate(NULL, 0, size);
-  memcpy(ints, c->ints, size);
-  r->ints = ints;
-  
   return r;
 }
 
+// The object comes first, so that the characters are never left without
+// an owner if allocating them fails.
 ObjString* copyString(const char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  char* heapChars = (char*)ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(NULL, length, hashString(chars, length));
+  string->chars = (char*)ALLOCATE(char, length + 1);
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  return string;
+}
+
+// The elements e of range c for which 'f op e' holds. Every filter but
+// '<>' leaves a range; '<>' cuts a hole in it, so that one is materialized.
+ObjCollection* filterRange(const ObjCollection* c, FilterOp op, int f) {
+  int lo = c->lo;
+  int hi = c->lo + c->count - 1;
+  switch (op) {
+  case FILTER_EQ:
+    if (f < lo || f > hi) { return initCollection(); }
+    return initRangeCollection(f, f);
+  case FILTER_GE: return initRangeCollection(lo, f < hi ? f : hi);
+  case FILTER_GT:
+    if (f <= lo) { return initCollection(); }
+    return initRangeCollection(lo, f - 1 < hi ? f - 1 : hi);
+  case FILTER_LE: return initRangeCollection(f > lo ? f : lo, hi);
+  case FILTER_LT:
+    if (f >= hi) { return initCollection(); }
+    return initRangeCollection(f + 1 > lo ? f + 1 : lo, hi);
+  case FILTER_NEQ: {
+    ObjCollection* r = copyCollection(c);
+    if (f >= lo && f <= hi) {
+      flattenCollection(r);
+      removeAtIndex(r, f - lo);
+    }
+    return r;
+  }
+  }
+  return initCollection();
 }
 
 int findFirstIndex(const ObjCollection* c, int element) {
+  if (!fitsWidth(element, c->width)) { return -1; }
+
   for (int i = 0; i < c->count; i++) {
-    if (c->ints[i] == element) {
+    if (elementAt(c, i) == element) {
       return i;
     }
   }
@@ -75,11 +157,174 @@ int findFirstIndex(const ObjCollection* c, int element) {
   return -1;
 }
 
+void fprintObject(FILE* file, Value value) {
+  switch (OBJ_TYPE(value)) {
+  case OBJ_COLLECTION: {
+    ObjCollection* c = AS_COLLECTION(value);
+    if (IS_COUNTED(c)) {
+      bool first = true;
+      for (int i = 0; i < c->span; i++) {
+        for (int j = 0; j < c->counts[i]; j++) {
+          fprintf(file, first ? "%d" : ", %d", c->lo + i);
+          first = false;
+        }
+      }
+      break;
+    }
+    if (IS_RANGE(c)) {
+      for (int i = 0; i < c->count; i++) {
+        fprintf(file, i == 0 ? "%d" : ", %d", c->lo + i);
+      }
+      break;
+    }
+    sortCollection(c);
+    for (int i = 0; i < c->count; i++) {
+      fprintf(file, "%d", elementAt(c, i));
+      if (i != c->count - 1) {
+        fprintf(file, ", ");
+      }
+    }
+  }
+    break;
+  case OBJ_PAIR: {
+    ObjPair* p = AS_PAIR(value);
+    fprintf(file, "[");
+    fprintValue(file, p->a); fprintf(file, ", "); fprintValue(file, p->b);
+    fprintf(file, "]");
+  }
+    break;
+  case OBJ_STRING: fprintf(file, "%s", AS_CSTRING(value)); break;
+  }
+}
+
+static void freeObject(Obj* object) {
+  switch (object->type) {
+  case OBJ_COLLECTION: {
+    ObjCollection* c = (ObjCollection*)object;
+    if (IS_COUNTED(c)) {
+      FREE_ARRAY(int, c->counts, c->span);
+    } else {
+      reallocate(c->elements, (size_t)c->capacity * elementSize(c->width), 0);
+    }
+    FREE(ObjCollection, object);
+    break;
+  }
+  case OBJ_PAIR:
+    FREE(ObjPair, object);
+    break;
+  case OBJ_STRING: {
+    ObjString* string = (ObjString*)object;
+    FREE_ARRAY(char, string->chars, string->length + 1);
+    FREE(ObjString, object);
+    break;
+  }
+  }
+}
+
+// Frees the objects allocated since objectMark returned mark, newest
+// first. Nothing allocated earlier may refer to them.
+void freeObjectsSince(Obj* mark) {
+  while (objects != mark) {
+    Obj* next = objects->next;
+    freeObject(objects);
+    objects = next;
+  }
+}
+
+// Frees a list of objects that takeObjectsSince returned.
+void freeObjectList(Obj* list) {
+  while (list != NULL) {
+    Obj* next = list->next;
+    freeObject(list);
+    list = next;
+  }
+}
+
+// Switches a counted or range collection to the list representation,
+// with the elements in ascending order.
+void flattenCollection(ObjCollection* c) {
+  if (c->kind == COLLECTION_LIST) { return; }
+
+  int hi = IS_RANGE(c) ? c->lo + c->count - 1 : c->lo + c->span - 1;
+  ElementWidth width = widthForRange(c->lo, hi);
+
+  void* elements = reallocate(NULL, 0, (size_t)c->count * elementSize(width));
+  if (IS_RANGE(c)) {
+    for (int i = 0; i < c->count; i++) {
+      storeElement(elements, width, i, c->lo + i);
+    }
+  } else {
+    int k = 0;
+    for (int i = 0; i < c->span; i++) {
+      for (int j = 0; j < c->counts[i]; j++) {
+        storeElement(elements, width, k++, c->lo + i);
+      }
+    }
+    FREE_ARRAY(int, c->counts, c->span);
+  }
+
+  c->kind = COLLECTION_LIST;
+  c->width = width;
+  c->elements = elements;
+  c->capacity = c->count;
+  c->counts = NULL;
+  c->lo = 0;
+  c->span = 0;
+}
+
 ObjCollection* initCollection() {
   ObjCollection* c = ALLOCATE_OBJ(ObjCollection, OBJ_COLLECTION);
+  c->kind = COLLECTION_LIST;
+  c->shared = false;
+  c->width = WIDTH_8;
   c->capacity = 0;
   c->count = 0;
-  c->ints = NULL;
+  c->elements = NULL;
+  c->lo = 0;
+  c->span = 0;
+  c->counts = NULL;
+  return c;
+}
+
+// An empty collection that stores how often each value in [lo, hi] occurs.
+ObjCollection* initCountedCollection(int lo, int hi) {
+  ObjCollection* c = initCollection();
+  c->kind = COLLECTION_COUNTS;
+  c->lo = lo;
+  c->span = hi - lo + 1;
+  c->counts = ALLOCATE(int, c->span);
+  memset(c->counts, 0, c->span * sizeof(int));
+  return c;
+}
+
+// An empty collection for n values drawn from [lo, hi]; counted when the
+// pool is larger than the range of values, since the counts are then both
+// smaller and faster to work with than the elements themselves.
+ObjCollection* initPoolCollection(int n, int lo, int hi) {
+  if (n > hi - lo + 1) {
+    return initCountedCollection(lo, hi);
+  }
+  return initCollection();
+}
+
+// Every integer in [lo, hi], without storing any of them; empty (and a
+// plain list) when hi < lo.
+ObjCollection* initRangeCollection(int lo, int hi) {
+  ObjCollection* c = initCollection();
+  if (hi >= lo) {
+    c->kind = COLLECTION_RANGE;
+    c->lo = lo;
+    c->count = hi - lo + 1;
+  }
+  return c;
+}
+
+// An empty list with room for capacity elements of the given width.
+ObjCollection* initSizedCollection(int capacity, ElementWidth width) {
+  ObjCollection* c = initCollection();
+  c->width = width;
+  c->capacity = capacity;
+  c->elements = reallocate(NULL, 0, (size_t)capacity * elementSize(width));
   return c;
 }
 
@@ -91,45 +336,55 @@ ObjPair* initPair(Value a, Value b) {
 }
 
 int member(ObjCollection* c, int item) {
+  if (IS_COUNTED(c)) {
+    return item >= c->lo && item - c->lo < c->span && c->counts[item - c->lo] > 0;
+  }
+  if (IS_RANGE(c)) {
+    return item >= c->lo && item <= c->lo + c->count - 1;
+  }
+
+  if (!fitsWidth(item, c->width)) { return 0; }
+
   for (int i = 0; i < c->count; i++) {
-    if (item == c->ints[i]) { return 1; }
+    if (item == elementAt(c, i)) { return 1; }
   }
   
   return 0;
 }
 
-void printObject(Value value) {
-  switch (OBJ_TYPE(value)) {
-  case OBJ_COLLECTION: {
-    ObjCollection* c = AS_COLLECTION(value);
-    sortCollection(c);
-    for (int i = 0; i < c->count; i++) {
-      printf("%d", c->ints[i]);
-      if (i != c->count - 1) {
-        printf(", ");
-      }
-    }
-  }
-    break;
-  case OBJ_PAIR: {
-    ObjPair* p = AS_PAIR(value);
-    printf("[");
-    printValue(p->a); printf(", "); printValue(p->b);
-    printf("]");
-  }
-    break;
-  case OBJ_STRING: printf("%s", AS_CSTRING(value)); break;
-  }
+// The newest object the calling thread has allocated, to free everything
+// after it later with freeObjectsSince.
+Obj* objectMark(void) {
+  return objects;
+}
+
+// c itself when the caller may write to it, otherwise a private copy.
+ObjCollection* ownCollection(ObjCollection* c) {
+  return c->shared ? copyCollection(c) : c;
 }
 
 // TODO: when count/capacity reaches ??, shrink the array
 void removeAtIndex(ObjCollection* c, int index) {
-  for (int i = index; i < c->count; i++) {
-    c->ints[i] = c->ints[i+1];
-  }
+  size_t size = elementSize(c->width);
+  char* elements = (char*)c->elements;
+  memmove(elements + index * size, elements + (index + 1) * size, (c->count - index - 1) * size);
   c->count--;
 }
 
+// Makes c a list with room for at least capacity elements, stored at
+// least as wide as width, so that they can be added with appendElement.
+void reserveCollection(ObjCollection* c, int capacity, ElementWidth width) {
+  flattenCollection(c);
+  if (width > c->width) {
+    widenCollection(c, width);
+  }
+  if (capacity > c->capacity) {
+    size_t size = elementSize(c->width);
+    c->elements = reallocate(c->elements, (size_t)c->capacity * size, (size_t)capacity * size);
+    c->capacity = capacity;
+  }
+}
+
 ////////////////////////////////////////////////
 ////////////////////////////////////////////////
 
@@ -137,35 +392,74 @@ void removeAtIndex(ObjCollection* c, int index) {
 // consider switching to heapsort (which does require nel*sizeof(el) additional
 // space).
 
-static int rcomp(const void* e1, const void* e2) {
-  int f = *((int*)e1);
-  int s = *((int*)e2);
-
-  if (f > s) { return -1; }
-  if (f < s) { return 1; }
-  return 0;
-}
+#define DEFINE_COMPARATORS(T, bits)                     \
+  static int rcomp##bits(const void* e1, const void* e2) { \
+    T f = *((const T*)e1);                              \
+    T s = *((const T*)e2);                              \
+                                                        \
+    if (f > s) { return -1; }                           \
+    if (f < s) { return 1; }                            \
+    return 0;                                           \
+  }                                                     \
+                                                        \
+  static int comp##bits(const void* e1, const void* e2) { \
+    T f = *((const T*)e1);                              \
+    T s = *((const T*)e2);                              \
+                                                        \
+    if (f > s) { return 1; }                            \
+    if (f < s) { return -1; }                           \
+    return 0;                                           \
+  }
 
-static int comp(const void* e1, const void* e2) {
-  int f = *((int*)e1);
-  int s = *((int*)e2);
+DEFINE_COMPARATORS(int8_t, 8)
+DEFINE_COMPARATORS(int16_t, 16)
+DEFINE_COMPARATORS(int32_t, 32)
 
-  if (f > s) { return 1; }
-  if (f < s) { return -1; }
-  return 0;
-}
+static int (*const rcomps[])(const void*, const void*) = { rcomp8, rcomp16, rcomp32 };
+static int (*const comps[])(const void*, const void*) = { comp8, comp16, comp32 };
 
 void reverseSortCollection(ObjCollection* c) {
-    qsort(c->ints, c->count, sizeof(int), rcomp);
+    flattenCollection(c);
+    qsort(c->elements, c->count, elementSize(c->width), rcomps[c->width]);
 }
 
 void sortCollection(ObjCollection* c) {
-    qsort(c->ints, c->count, sizeof(int), comp);
+    if (c->kind != COLLECTION_LIST) {
+      flattenCollection(c);
+      return;
+    }
+    qsort(c->elements, c->count, elementSize(c->width), comps[c->width]);
 }
 
 ////////////////////////////////////////////////
 ////////////////////////////////////////////////
 
+// Marks every collection reachable from value as shared.
+void shareValue(Value value) {
+  if (IS_COLLECTION(value)) {
+    AS_COLLECTION(value)->shared = true;
+  } else if (IS_PAIR(value)) {
+    shareValue(AS_PAIR(value)->a);
+    shareValue(AS_PAIR(value)->b);
+  }
+}
+
+// Takes the objects allocated since objectMark returned mark off the
+// calling thread's list, for whatever they belong to to free later with
+// freeObjectList, on any thread.
+Obj* takeObjectsSince(Obj* mark) {
+  if (objects == mark) { return NULL; }
+
+  Obj* taken = objects;
+  Obj* last = taken;
+  while (last->next != mark) {
+    last = last->next;
+  }
+  last->next = NULL;
+  objects = mark;
+  return taken;
+}
+
 ObjString* takeString(char* chars, int length) {
   uint32_t hash = hashString(chars, length);
   return allocateString(chars, length, hash);
@@ -2,6 +2,7 @@
 #define _tvm_object_h
 
 #include "common.h"
+#include "kernels.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -15,6 +16,15 @@
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
+typedef enum {
+  COLLECTION_LIST,   // one slot per element in elements, in no particular order
+  COLLECTION_COUNTS, // counts[i] is the number of times lo + i occurs
+  COLLECTION_RANGE   // every integer in [lo, lo + count), with no storage
+} CollectionKind;
+
+#define IS_COUNTED(c) ((c)->kind == COLLECTION_COUNTS)
+#define IS_RANGE(c) ((c)->kind == COLLECTION_RANGE)
+
 typedef enum {
   OBJ_COLLECTION,
   OBJ_PAIR,
@@ -23,13 +33,33 @@ typedef enum {
 
 struct Obj {
   ObjType type;
+  struct Obj* next;
 };
 
+// List elements are stored in the narrowest width that holds all of
+// them; addToCollection widens the array when a value doesn't fit.
+//
+// A collection that isn't shared is referenced only from the stack, so
+// the op that pops it may reuse its storage for the result. Once a global
+// refers to it, it is shared and ownCollection copies it before the first
+// write. Sorting and flattening don't change the value and happen in
+// place either way.
 struct ObjCollection {
   Obj obj;
+  CollectionKind kind;
+  bool shared;
+  ElementWidth width;
   int count;
   int capacity;
-  int* ints;
+  union {
+    void* elements;
+    int8_t* ints8;
+    int16_t* ints16;
+    int32_t* ints32;
+  };
+  int lo;
+  int span;
+  int* counts;
 };
 
 struct ObjPair {
@@ -46,20 +76,63 @@ struct ObjString {
 };
 
 void addToCollection(ObjCollection* c, int n);
+int countedElementAt(const ObjCollection* c, int index);
 ObjCollection* copyCollection(const ObjCollection* c);
 ObjString* copyString(const char* chars, int length);
+void fprintObject(FILE* file, Value value);
+void freeObjectList(Obj* list);
+void freeObjectsSince(Obj* mark);
+ObjCollection* filterRange(const ObjCollection* c, FilterOp op, int f);
 int findFirstIndex(const ObjCollection* c, int element);
+void flattenCollection(ObjCollection* c);
 ObjCollection* initCollection(void);
+ObjCollection* initCountedCollection(int lo, int hi);
+ObjCollection* initPoolCollection(int n, int lo, int hi);
+ObjCollection* initRangeCollection(int lo, int hi);
+ObjCollection* initSizedCollection(int capacity, ElementWidth width);
 ObjPair* initPair(Value a, Value b);
 int member(ObjCollection* c, int item);
-void printObject(Value value);
+Obj* objectMark(void);
+ObjCollection* ownCollection(ObjCollection* c);
 void removeAtIndex(ObjCollection* c, int index);
+void reserveCollection(ObjCollection* c, int capacity, ElementWidth width);
 void reverseSortCollection(ObjCollection* c);
+void shareValue(Value value);
 void sortCollection(ObjCollection* c);
+Obj* takeObjectsSince(Obj* mark);
 ObjString* takeString(char* chars, int length);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline int loadElement(const void* elements, ElementWidth width, int index) {
+  switch (width) {
+  case WIDTH_8: return ((const int8_t*)elements)[index];
+  case WIDTH_16: return ((const int16_t*)elements)[index];
+  case WIDTH_32: return ((const int32_t*)elements)[index];
+  }
+  return 0;
+}
+
+static inline void storeElement(void* elements, ElementWidth width, int index, int n) {
+  switch (width) {
+  case WIDTH_8: ((int8_t*)elements)[index] = (int8_t)n; break;
+  case WIDTH_16: ((int16_t*)elements)[index] = (int16_t)n; break;
+  case WIDTH_32: ((int32_t*)elements)[index] = n; break;
+  }
+}
+
+// Adds n to a list without any checks: the caller has made sure, with
+// reserveCollection or initSizedCollection, that there is room for it and
+// that it fits the width.
+static inline void appendElement(ObjCollection* c, int n) {
+  storeElement(c->elements, c->width, c->count, n);
+  c->count++;
+}
+
+static inline int elementAt(const ObjCollection* c, int index) {
+  return loadElement(c->elements, c->width, index);
+}
+
 #endif
@@ -0,0 +1,390 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "pool.h"
+
+// Blocks first to end - 1 of a job.
+typedef struct {
+  Job* job;
+  uint64_t first;
+  uint64_t end;
+} Task;
+
+// The worker that owns a queue takes from the back, the newest and
+// smallest halves; everyone else takes from the front.
+typedef struct {
+  Task* tasks;
+  size_t head;
+  size_t tail;
+  size_t capacity;
+} TaskQueue;
+
+// A printed block that finished before the blocks ahead of it.
+typedef struct BlockResult {
+  char* text;
+  size_t size;
+} BlockResult;
+
+// Aligned so that workers never share a cache line.
+typedef struct {
+  _Alignas(CACHE_LINE) pthread_mutex_t lock; // for tasks
+  TaskQueue tasks;
+  pthread_t thread;
+  Job* tallying;    // the job totals belongs to
+  uint64_t tallied; // blocks of it in totals
+  Totals totals;
+  FILE* errors;     // the worker's VM's
+  char* error;
+  size_t errorSize;
+} Worker;
+
+static void addTask(TaskQueue* queue, Task task);
+static void announce(void);
+static bool findTask(Worker* worker, Task* task);
+static void finishJob(Job* job);
+static void flushTotals(Worker* worker);
+static void printBlock(Job* job, uint64_t block, BlockResult* result);
+static void runBlock(Worker* worker, Job* job, uint64_t block);
+static void* runWorker(void* arg);
+static bool takeBack(TaskQueue* queue, Task* task);
+static bool takeFront(TaskQueue* queue, Task* task);
+
+// lock covers the two lanes, the sleepers and the finished list.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static TaskQueue fastLane; // jobs of one block
+static TaskQueue jobs;     // bigger jobs, whole
+static atomic_size_t available = 0; // tasks on any queue
+static int sleepers = 0;
+static Worker* workers;
+static int workerCount;
+static PoolSampling sampling;
+static Job* finished = NULL;
+static int signalFd;
+
+static void addTask(TaskQueue* queue, Task task) {
+  if (queue->tail == queue->capacity && queue->head > 0) {
+    memmove(queue->tasks, queue->tasks + queue->head, (queue->tail - queue->head) * sizeof(Task));
+    queue->tail -= queue->head;
+    queue->head = 0;
+  }
+  if (queue->tail == queue->capacity) {
+    size_t capacity = GROW_CAPACITY(queue->capacity);
+    queue->tasks = GROW_ARRAY(Task, queue->tasks, queue->capacity, capacity);
+    queue->capacity = capacity;
+  }
+  queue->tasks[queue->tail++] = task;
+}
+
+// After a task is queued: wakes a worker, if one is asleep.
+static void announce() {
+  pthread_mutex_lock(&lock);
+  atomic_fetch_add(&available, 1);
+  if (sleepers > 0) {
+    pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Small jobs first, then the worker's own work, then anyone else's, and
+// only then a new big job.
+static bool findTask(Worker* worker, Task* task) {
+  pthread_mutex_lock(&lock);
+  bool found = takeFront(&fastLane, task);
+  pthread_mutex_unlock(&lock);
+
+  if (!found) {
+    pthread_mutex_lock(&worker->lock);
+    found = takeBack(&worker->tasks, task);
+    pthread_mutex_unlock(&worker->lock);
+  }
+  int index = (int)(worker - workers);
+  for (int i = 1; !found && i < workerCount; i++) {
+    Worker* victim = &workers[(index + i) % workerCount];
+    pthread_mutex_lock(&victim->lock);
+    found = takeFront(&victim->tasks, task);
+    pthread_mutex_unlock(&victim->lock);
+  }
+  if (!found) {
+    pthread_mutex_lock(&lock);
+    found = takeFront(&jobs, task);
+    pthread_mutex_unlock(&lock);
+  }
+
+  if (found) {
+    atomic_fetch_sub(&available, 1);
+  }
+  return found;
+}
+
+static void finishJob(Job* job) {
+  fclose(job->output);
+  job->output = NULL;
+
+  pthread_mutex_lock(&lock);
+  job->next = finished;
+  finished = job;
+  pthread_mutex_unlock(&lock);
+  uint64_t one = 1;
+  if (write(signalFd, &one, sizeof(one)) < 0) {
+    // Only fails if the counter is about to overflow, when it's readable
+    // anyway.
+  }
+}
+
+Job* finishedJobs() {
+  uint64_t count;
+  if (read(signalFd, &count, sizeof(count)) < 0) {
+    // Nothing had finished.
+  }
+
+  pthread_mutex_lock(&lock);
+  Job* list = finished;
+  finished = NULL;
+  pthread_mutex_unlock(&lock);
+  return list;
+}
+
+// Merges the worker's totals into their job's.
+static void flushTotals(Worker* worker) {
+  Job* job = worker->tallying;
+  if (job == NULL) { return; }
+
+  pthread_mutex_lock(&job->lock);
+  if (job->failedAt == job->blocks) {
+    mergeTotals(&job->totals, &worker->totals, job->sink);
+  }
+  job->remaining -= worker->tallied;
+  bool done = job->remaining == 0;
+  pthread_mutex_unlock(&job->lock);
+
+  freeTotals(&worker->totals);
+  initTotals(&worker->totals);
+  worker->tallying = NULL;
+  worker->tallied = 0;
+  if (done) {
+    finishJob(job);
+  }
+}
+
+void freeJob(Job* job) {
+  freeTotals(&job->totals);
+  pthread_mutex_destroy(&job->lock);
+  free(job->text);
+  free(job->error);
+  FREE_ARRAY(BlockResult*, job->parked, job->blocks);
+  free(job);
+}
+
+Job* newJob(Chunk* chunk, Sink sink, uint64_t samples, uint64_t seed, uint64_t stream,
+            void* owner) {
+  Job* job = (Job*)allocateAligned(CACHE_LINE, sizeof(Job));
+  memset(job, 0, sizeof(Job));
+  initTotals(&job->totals);
+  job->chunk = chunk;
+  job->sink = sink;
+  job->samples = samples;
+  job->seed = seed;
+  job->stream = stream;
+  job->owner = owner;
+
+  pthread_mutex_init(&job->lock, NULL);
+  job->output = open_memstream(&job->text, &job->textSize);
+  if (job->output == NULL) { failAllocation(); }
+  job->blocks = samples / POOL_BLOCK + (samples % POOL_BLOCK != 0);
+  job->remaining = job->blocks;
+  job->failedAt = job->blocks;
+  if (sink == SINK_OUTPUT && job->blocks > 1) {
+    job->parked = ALLOCATE(BlockResult*, job->blocks);
+    memset(job->parked, 0, job->blocks * sizeof(BlockResult*));
+  }
+  return job;
+}
+
+int poolSignal() {
+  return signalFd;
+}
+
+// Adds a finished block's printed results to the job's text, along with
+// those of any blocks after it that were waiting for it.
+static void printBlock(Job* job, uint64_t block, BlockResult* result) {
+  if (block != job->printed) {
+    job->parked[block] = ALLOCATE(BlockResult, 1);
+    *job->parked[block] = *result;
+    return;
+  }
+
+  fwrite(result->text, 1, result->size, job->output);
+  free(result->text);
+  for (job->printed++; job->printed < job->blocks && job->parked[job->printed] != NULL; job->printed++) {
+    BlockResult* parked = job->parked[job->printed];
+    fwrite(parked->text, 1, parked->size, job->output);
+    free(parked->text);
+    FREE(BlockResult, parked);
+  }
+}
+
+// Blocks after one that failed aren't run.
+static void runBlock(Worker* worker, Job* job, uint64_t block) {
+  pthread_mutex_lock(&job->lock);
+  bool skipped = block > job->failedAt;
+  pthread_mutex_unlock(&job->lock);
+
+  // A job of one block is the worker's alone.
+  Totals* totals = &job->totals;
+  if (job->blocks > 1 && job->sink != SINK_OUTPUT) {
+    worker->tallying = job;
+    totals = &worker->totals;
+  }
+
+  BlockResult result = { NULL, 0 };
+  bool failed = false;
+  rewind(worker->errors);
+  if (!skipped) {
+    FILE* out = job->sink == SINK_OUTPUT ? open_memstream(&result.text, &result.size) : NULL;
+    if (job->sink == SINK_OUTPUT && out == NULL) { failAllocation(); }
+    setSeed(job->seed);
+    setStream(job->stream);
+    uint64_t first = block * POOL_BLOCK;
+    uint64_t end = job->samples - first < POOL_BLOCK ? job->samples : first + POOL_BLOCK;
+    for (uint64_t i = first; i < end && !failed; i++) {
+      Value value;
+      if (runSample(job->chunk, job->first + i, &value) != INTERPRET_OK) {
+        failed = true;
+      } else if (out != NULL) {
+        fprintValue(out, value);
+        fputc('\n', out);
+      } else if (!tallyResult(totals, job->sink, value, job->first + i, worker->errors)) {
+        failed = true;
+      }
+    }
+    if (out != NULL) {
+      fclose(out);
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  if (failed && block < job->failedAt) {
+    job->failedAt = block;
+    fflush(worker->errors);
+    size_t size = (size_t)ftell(worker->errors);
+    free(job->error);
+    job->error = ALLOCATE(char, size + 1);
+    memcpy(job->error, worker->error, size);
+    job->error[size] = '\0';
+  }
+  if (job->sink == SINK_OUTPUT) {
+    printBlock(job, block, &result);
+  }
+  bool done = false;
+  if (totals == &worker->totals) {
+    worker->tallied++;
+  } else {
+    done = --job->remaining == 0;
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  if (done) {
+    finishJob(job);
+  }
+}
+
+// A worker's totals are merged when it takes a task from another job, so
+// a job is never left waiting on a worker that's busy elsewhere.
+static void* runWorker(void* arg) {
+  Worker* worker = (Worker*)arg;
+  initVM();
+  setPoolSampling(sampling);
+  setErrors(worker->errors);
+
+  for (;;) {
+    Task task;
+    if (!findTask(worker, &task)) {
+      flushTotals(worker);
+      pthread_mutex_lock(&lock);
+      while (atomic_load(&available) == 0) {
+        sleepers++;
+        pthread_cond_wait(&wake, &lock);
+        sleepers--;
+      }
+      pthread_mutex_unlock(&lock);
+      continue;
+    }
+    if (task.job != worker->tallying) {
+      flushTotals(worker);
+    }
+
+    // Keeps all but the first block for later, in halves.
+    while (task.end - task.first > 1) {
+      uint64_t middle = task.first + (task.end - task.first) / 2;
+      pthread_mutex_lock(&worker->lock);
+      addTask(&worker->tasks, (Task){ task.job, middle, task.end });
+      pthread_mutex_unlock(&worker->lock);
+      announce();
+      task.end = middle;
+    }
+    runBlock(worker, task.job, task.first);
+  }
+  return NULL;
+}
+
+void startPool(int count, PoolSampling poolSampling) {
+  sampling = poolSampling;
+  signalFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  workerCount = count;
+  workers = (Worker*)allocateAligned(CACHE_LINE, count * sizeof(Worker));
+  memset(workers, 0, count * sizeof(Worker));
+  bool started = signalFd >= 0;
+  for (int i = 0; i < count; i++) {
+    Worker* worker = &workers[i];
+    pthread_mutex_init(&worker->lock, NULL);
+    initTotals(&worker->totals);
+    worker->errors = open_memstream(&worker->error, &worker->errorSize);
+    started = started && worker->errors != NULL;
+  }
+  // Only once every worker is there to steal from.
+  for (int i = 0; i < count && started; i++) {
+    started = pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) == 0;
+  }
+  if (!started) {
+    fprintf(stderr, "Could not start %d workers.\n", count);
+    exit(74);
+  }
+}
+
+void submitJob(Job* job) {
+  if (job->blocks == 0) {
+    finishJob(job);
+    return;
+  }
+
+  Task task = { job, 0, job->blocks };
+  pthread_mutex_lock(&lock);
+  addTask(job->blocks == 1 ? &fastLane : &jobs, task);
+  pthread_mutex_unlock(&lock);
+  announce();
+}
+
+static bool takeBack(TaskQueue* queue, Task* task) {
+  if (queue->head == queue->tail) { return false; }
+
+  *task = queue->tasks[--queue->tail];
+  if (queue->head == queue->tail) {
+    queue->head = queue->tail = 0;
+  }
+  return true;
+}
+
+static bool takeFront(TaskQueue* queue, Task* task) {
+  if (queue->head == queue->tail) { return false; }
+
+  *task = queue->tasks[queue->head++];
+  if (queue->head == queue->tail) {
+    queue->head = queue->tail = 0;
+  }
+  return true;
+}
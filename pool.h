@@ -0,0 +1,74 @@
+#ifndef tvm_pool_h
+#define tvm_pool_h
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "totals.h"
+#include "vm.h"
+
+// The worker threads behind tvm --serve and --batch. A job's samples are
+// cut into blocks of POOL_BLOCK. A job of one block goes on a fast lane
+// that every worker checks between blocks, so a d20 never waits behind a
+// 10^8-sample distribution for longer than one block takes. A bigger job
+// is handed out whole and halved as it's worked on: a worker keeps one
+// half on its own deque and goes on halving the other down to a block,
+// and a worker with nothing to do steals the oldest (so biggest) half
+// from another's.
+//
+// Each worker tallies the blocks it runs of a job into its own totals and
+// merges them into the job's when it moves on to another job or runs out
+// of work. Counts come out the same whoever ran what; --stats' moments
+// and quantiles can differ in the last places, as they do between
+// tvm --threads counts. Printed results are put back in sample order, and
+// a job that fails reports the first sample that did.
+
+#define POOL_BLOCK 4096
+
+typedef struct Job Job;
+
+struct Job {
+  Totals totals;  // first, for its alignment
+  Chunk* chunk;
+  Sink sink;
+  uint64_t first;  // of the stream's samples; 0 unless set after newJob
+  uint64_t samples;
+  uint64_t seed;
+  uint64_t stream;
+  void* owner;    // whoever submitted it
+
+  // Once it's finished: the printed results for SINK_OUTPUT, and why it
+  // failed if it did.
+  char* text;
+  size_t textSize;
+  char* error;
+  Job* next;      // on the finished list
+
+  // The pool's.
+  pthread_mutex_t lock;
+  FILE* output;
+  uint64_t blocks;
+  uint64_t remaining;  // blocks not yet merged in
+  uint64_t printed;    // blocks whose results are in text
+  uint64_t failedAt;   // the first block that failed, or blocks
+  struct BlockResult** parked; // printed blocks that finished early
+};
+
+// The pool is started once, with the VM settings every worker uses.
+void startPool(int workers, PoolSampling poolSampling);
+
+// A file descriptor that's readable while there are finished jobs.
+int poolSignal(void);
+
+Job* newJob(Chunk* chunk, Sink sink, uint64_t samples, uint64_t seed, uint64_t stream,
+            void* owner);
+void freeJob(Job* job);
+
+void submitJob(Job* job);
+
+// The jobs finished since the last call, linked through next.
+Job* finishedJobs(void);
+
+#endif
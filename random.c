@@ -1,14 +1,517 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "random.h"
 
-// These functions are to enable us to easily switch between different rngs
-// for different platforms. Probably/possibly use #ifdef #elsif ...
+// Every random number comes from one of the generators below, picked with
+// selectGenerator. None of them is cryptographic: sampling needs speed and
+// reproducible streams, not unpredictability.
+//
+// The numbers for sample i of stream s are a function of (seed, s, i)
+// alone: seekRandom puts the generator at the start of that sample, so a
+// sample can be rerun by itself, and on any thread, with the same result.
+// Philox gets there by setting its counter; the others are reseeded from
+// a hash of the three.
+
+typedef struct {
+  const char* name;
+  void (*seek)(uint64_t key, uint64_t sample); // key depends on seed and stream
+  void (*fill)(uint64_t* words, int n);        // the next n words, n even
+} Generator;
+
+// SplitMix64, used to spread a seed over the state of the generators.
+static uint64_t splitMix64(uint64_t* x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl64(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+// xoshiro256** (Blackman and Vigna, "Scrambled linear pseudorandom number
+// generators", 2018).
+
+static _Thread_local uint64_t xoshiroState[4];
+
+static void xoshiroSeek(uint64_t key, uint64_t sample) {
+  uint64_t seed = splitMix64(&key) ^ sample;
+  for (int i = 0; i < 4; i++) {
+    xoshiroState[i] = splitMix64(&seed);
+  }
+}
+
+static void xoshiroFill(uint64_t* words, int n) {
+  uint64_t s0 = xoshiroState[0], s1 = xoshiroState[1];
+  uint64_t s2 = xoshiroState[2], s3 = xoshiroState[3];
+
+  for (int i = 0; i < n; i++) {
+    words[i] = rotl64(s1 * 5, 7) * 9;
+    uint64_t t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = rotl64(s3, 45);
+  }
+
+  xoshiroState[0] = s0; xoshiroState[1] = s1;
+  xoshiroState[2] = s2; xoshiroState[3] = s3;
+}
+
+// PCG32, XSH-RR output (O'Neill, "PCG: A family of simple fast
+// space-efficient statistically good algorithms for random number
+// generation", 2014). Two outputs make one 64-bit word.
+
+static _Thread_local uint64_t pcgState;
+static const uint64_t pcgIncrement = 0xda3e39cb94b95bdbull | 1;
+
+static uint32_t pcgNext32(void) {
+  uint64_t old = pcgState;
+  pcgState = old * 6364136223846793005ull + pcgIncrement;
+  uint32_t xorShifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+  int rot = (int)(old >> 59);
+  return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+}
+
+static void pcgSeek(uint64_t key, uint64_t sample) {
+  uint64_t seed = splitMix64(&key) ^ sample;
+  seed = splitMix64(&seed);
+  pcgState = 0;
+  pcgNext32();
+  pcgState += seed;
+  pcgNext32();
+}
+
+static void pcgFill(uint64_t* words, int n) {
+  for (int i = 0; i < n; i++) {
+    uint64_t hi = pcgNext32();
+    words[i] = (hi << 32) | pcgNext32();
+  }
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3", 2011). Block b of a sample is the encryption of the counter
+// (b, sample) under the key, so seeking costs nothing and every block can
+// be computed independently of the others. Each block makes two words.
+
+typedef struct {
+  uint32_t key[2];
+  uint64_t block;
+  uint64_t sample;
+} Philox;
+
+static _Thread_local Philox philox;
+
+static inline void philoxRound(uint32_t* x, const uint32_t* k) {
+  uint64_t p0 = (uint64_t)0xd2511f53u * x[0];
+  uint64_t p1 = (uint64_t)0xcd9e8d57u * x[2];
+  uint32_t y0 = (uint32_t)(p1 >> 32) ^ x[1] ^ k[0];
+  uint32_t y2 = (uint32_t)(p0 >> 32) ^ x[3] ^ k[1];
+  x[1] = (uint32_t)p1;
+  x[3] = (uint32_t)p0;
+  x[0] = y0;
+  x[2] = y2;
+}
+
+static void philoxBlock(uint64_t block, uint32_t* x) {
+  x[0] = (uint32_t)block;
+  x[1] = (uint32_t)(block >> 32);
+  x[2] = (uint32_t)philox.sample;
+  x[3] = (uint32_t)(philox.sample >> 32);
+  uint32_t k[2] = { philox.key[0], philox.key[1] };
+
+  for (int round = 0; round < 10; round++) {
+    if (round > 0) {
+      k[0] += 0x9e3779b9u;
+      k[1] += 0xbb67ae85u;
+    }
+    philoxRound(x, k);
+  }
+}
+
+static void philoxSeek(uint64_t key, uint64_t sample) {
+  philox.key[0] = (uint32_t)key;
+  philox.key[1] = (uint32_t)(key >> 32);
+  philox.block = 0;
+  philox.sample = sample;
+}
+
+static void philoxFill(uint64_t* words, int n) {
+  for (int i = 0; i < n; i += 2) {
+    uint32_t x[4];
+    philoxBlock(philox.block + i / 2, x);
+    words[i] = ((uint64_t)x[0] << 32) | x[1];
+    words[i + 1] = ((uint64_t)x[2] << 32) | x[3];
+  }
+  philox.block += n / 2;
+}
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+static const Generator generators[] = {
+  { "xoshiro", xoshiroSeek, xoshiroFill },
+  { "pcg", pcgSeek, pcgFill },
+  { "philox", philoxSeek, philoxFill }
+};
+
+static const Generator* generator = &generators[0];
+
+// Words are made in bulk. A sample that rolls a single die shouldn't pay
+// for a whole buffer, so each refill after a seek is twice the last one.
+#define RANDOM_BUFFER 64
+
+typedef struct {
+  uint64_t words[RANDOM_BUFFER];
+  int size;
+  int next;
+} WordBuffer;
+
+static _Thread_local WordBuffer buffer;
+
+// Dice with a small number of faces come in batches, several from one
+// word (Brackett-Rozinsky and Lemire, "Batched ranged random integer
+// generation", 2024). A word x is accepted for a batch of k dice with
+// 'faces' faces when x * faces^k mod 2^64 is at least 2^64 mod faces^k;
+// the high halves of successive products with faces then are k
+// independent uniform dice.
+#define BATCH_BITS 56
+
+typedef struct {
+  int faces;
+  int size;
+  uint64_t product;
+  uint64_t threshold;
+  uint64_t word;
+  int left;
+} DiceBatch;
+
+static _Thread_local DiceBatch batch;
+
+////////////////////////////////////////////////
+////////////////////////////////////////////////
+
+// Samplers change the words a sample sees, to estimate statistics of the
+// result with less variance than independent samples. Every sample still
+// has the right distribution, except that stratified samples only do
+// together: averages over them are unbiased.
+//
+// - antithetic: odd samples see the complement of the words the sample
+//   before them saw, so every die d of n faces becomes n - 1 - d.
+// - stratified: the first word of sample i starts with point i of an
+//   Owen scrambled van der Corput sequence. Samples 0 to 2^m - 1 then put
+//   exactly one first word in each of 2^m equal intervals, at a uniformly
+//   random place in it, which spreads the first die over its faces.
+// - sobol: the same, for the first SOBOL_DIMENSIONS words, with word j
+//   taken from coordinate j of a Sobol sequence (whose first coordinate
+//   is van der Corput's). Best for programs that always make the same
+//   number of draws.
+
+typedef enum {
+  SAMPLER_RANDOM,
+  SAMPLER_ANTITHETIC,
+  SAMPLER_STRATIFIED,
+  SAMPLER_SOBOL
+} Sampler;
+
+static const char* const samplerNames[] = { "random", "antithetic", "stratified", "sobol" };
+
+static Sampler sampler = SAMPLER_RANDOM;
+
+typedef struct {
+  uint64_t key;
+  uint64_t sample;
+  int word; // words handed out since the seek
+} SamplePosition;
+
+static _Thread_local SamplePosition position;
+
+// Joe and Kuo's direction numbers (new-joe-kuo-6.21201) for the first
+// dimensions: the degree and coefficients of each primitive polynomial
+// and its initial m values. The first dimension is van der Corput's.
+#define SOBOL_DIMENSIONS 21
+#define SOBOL_BITS 32
+
+static const struct {
+  int degree;
+  int coefficients;
+  int m[7];
+} sobolPolynomials[SOBOL_DIMENSIONS - 1] = {
+  { 1, 0, { 1 } },
+  { 2, 1, { 1, 3 } },
+  { 3, 1, { 1, 3, 1 } },
+  { 3, 2, { 1, 1, 1 } },
+  { 4, 1, { 1, 1, 3, 3 } },
+  { 4, 4, { 1, 3, 5, 13 } },
+  { 5, 2, { 1, 1, 5, 5, 17 } },
+  { 5, 4, { 1, 1, 5, 5, 5 } },
+  { 5, 7, { 1, 1, 7, 11, 19 } },
+  { 5, 11, { 1, 1, 5, 1, 1 } },
+  { 5, 13, { 1, 1, 1, 3, 11 } },
+  { 5, 14, { 1, 3, 5, 5, 31 } },
+  { 6, 1, { 1, 3, 3, 9, 7, 49 } },
+  { 6, 13, { 1, 1, 1, 15, 21, 21 } },
+  { 6, 16, { 1, 3, 1, 13, 27, 49 } },
+  { 6, 19, { 1, 1, 1, 15, 7, 5 } },
+  { 6, 22, { 1, 3, 1, 15, 13, 25 } },
+  { 6, 25, { 1, 1, 5, 5, 19, 61 } },
+  { 7, 1, { 1, 3, 7, 11, 23, 15, 103 } },
+  { 7, 4, { 1, 3, 7, 13, 13, 15, 69 } }
+};
+
+static uint32_t sobolDirections[SOBOL_DIMENSIONS][SOBOL_BITS];
+
+static void initSobol(void) {
+  for (int k = 0; k < SOBOL_BITS; k++) {
+    sobolDirections[0][k] = 1u << (SOBOL_BITS - 1 - k);
+  }
+
+  for (int d = 1; d < SOBOL_DIMENSIONS; d++) {
+    int s = sobolPolynomials[d - 1].degree;
+    int a = sobolPolynomials[d - 1].coefficients;
+    uint32_t* v = sobolDirections[d];
+    for (int k = 0; k < s; k++) {
+      v[k] = (uint32_t)sobolPolynomials[d - 1].m[k] << (SOBOL_BITS - 1 - k);
+    }
+    for (int k = s; k < SOBOL_BITS; k++) {
+      v[k] = v[k - s] ^ (v[k - s] >> s);
+      for (int l = 1; l < s; l++) {
+        if ((a >> (s - 1 - l)) & 1) {
+          v[k] ^= v[k - l];
+        }
+      }
+    }
+  }
+}
+
+static uint32_t reverseBits32(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling by hashing (Burley, "Practical hash-based Owen
+// scrambling", 2020): the Laine-Karras permutation only lets each bit
+// depend on the bits below it, so applying it to the reversed bits makes
+// every bit depend on the ones above it.
+static uint32_t owenScramble(uint32_t x, uint32_t seed) {
+  x = reverseBits32(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return reverseBits32(x);
+}
+
+static uint32_t sobolCoordinate(uint32_t index, int dimension) {
+  uint32_t x = 0;
+  for (int k = 0; index != 0; k++, index >>= 1) {
+    if (index & 1) {
+      x ^= sobolDirections[dimension][k];
+    }
+  }
+  return x;
+}
+
+static uint64_t sampleWord(uint64_t x) {
+  int word = position.word++;
+  switch (sampler) {
+  case SAMPLER_RANDOM:
+    return x;
+  case SAMPLER_ANTITHETIC:
+    return position.sample & 1 ? ~x : x;
+  case SAMPLER_STRATIFIED:
+  case SAMPLER_SOBOL: {
+    if (word >= (sampler == SAMPLER_SOBOL ? SOBOL_DIMENSIONS : 1)) { return x; }
+    uint64_t seed = position.key + (uint64_t)word;
+    uint32_t y = owenScramble(sobolCoordinate((uint32_t)position.sample, word),
+                              (uint32_t)splitMix64(&seed));
+    return ((uint64_t)y << 32) | (x & 0xffffffffu);
+  }
+  }
+  return x;
+}
+
+// A seed that differs from run to run.
+uint64_t entropySeed(void) {
+  uint64_t seed = 0;
+  FILE* file = fopen("/dev/urandom", "rb");
+  if (file != NULL) {
+    size_t n = fread(&seed, sizeof(seed), 1, file);
+    fclose(file);
+    if (n == 1) { return seed; }
+  }
+
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+uint64_t random64(void) {
+  if (buffer.next == buffer.size) {
+    buffer.size = buffer.size == 0 ? 4 : (int)fmin(buffer.size * 2, RANDOM_BUFFER);
+    generator->fill(buffer.words, buffer.size);
+    buffer.next = 0;
+  }
+  return sampleWord(buffer.words[buffer.next++]);
+}
+
+// Starts a new batch for dice with the given number of faces. The batch
+// size keeps faces^size below 2^BATCH_BITS, so that a word is rejected
+// with probability under 2^(BATCH_BITS - 64). A single die over a large
+// range is a batch of one, which is Lemire's nearly divisionless method.
+static void startBatch(int faces) {
+  if (faces != batch.faces) {
+    int bits = 64 - __builtin_clzll((uint64_t)faces - 1);
+    batch.faces = faces;
+    batch.size = bits < BATCH_BITS ? BATCH_BITS / bits : 1;
+    batch.product = 1;
+    for (int i = 0; i < batch.size; i++) {
+      batch.product *= (uint64_t)faces;
+    }
+    batch.threshold = -batch.product % batch.product;
+  }
+
+  uint64_t x = random64();
+  while (x * batch.product < batch.threshold) {
+    x = random64();
+  }
+  batch.word = x;
+  batch.left = batch.size;
+}
 
 int randomi(int upper) {
-  return arc4random_uniform(upper);
+  if (upper <= 1) { return 0; }
+
+  if (upper != batch.faces || batch.left == 0) {
+    startBatch(upper);
+  }
+  unsigned __int128 m = (unsigned __int128)batch.word * (uint64_t)upper;
+  batch.word = (uint64_t)m;
+  batch.left--;
+  return (int)(m >> 64);
+}
+
+void seekRandom(uint64_t seed, uint64_t stream, uint64_t sample) {
+  uint64_t key = seed;
+  key = splitMix64(&key) ^ stream;
+  key = splitMix64(&key);
+  // Both samples of an antithetic pair start from the same words.
+  generator->seek(key, sampler == SAMPLER_ANTITHETIC ? sample & ~1ull : sample);
+  position.key = key;
+  position.sample = sample;
+  position.word = 0;
+  buffer.size = 0;
+  buffer.next = 0;
+  batch.left = 0;
 }
 
+bool selectGenerator(const char* name) {
+  for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++) {
+    if (strcmp(generators[i].name, name) == 0) {
+      generator = &generators[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+bool selectSampler(const char* name) {
+  for (size_t i = 0; i < sizeof(samplerNames) / sizeof(samplerNames[0]); i++) {
+    if (strcmp(samplerNames[i], name) == 0) {
+      sampler = (Sampler)i;
+      initSobol();
+      return true;
+    }
+  }
+  return false;
+}
+
+// The top 53 bits of a word, scaled to [0, 1).
 double uniform() {
-  return (double)arc4random()/UINT32_MAX;
+  return (double)(random64() >> 11) * 0x1.0p-53;
+}
+
+// Inversion: walk the cdf from 0. Takes about n*p steps, so only used when
+// the mean is small.
+static int binomialInversion(int n, double p) {
+  double q = 1.0 - p;
+  double s = p / q;
+  double a = (n + 1) * s;
+  double r = pow(q, n);
+  double u = uniform();
+  int x = 0;
+
+  while (u > r && x < n) {
+    u -= r;
+    x++;
+    r *= a / x - s;
+  }
+  return x;
+}
+
+// Hörmann's BTRS (transformed rejection with squeeze), "The generation of
+// binomial random variates", 1993. Requires p <= 0.5 and n * p >= 10;
+// expected cost is a small constant number of uniforms.
+static int binomialBtrs(int n, double p) {
+  double q = 1.0 - p;
+  double spq = sqrt(n * p * q);
+  double b = 1.15 + 2.53 * spq;
+  double a = -0.0873 + 0.0248 * b + 0.01 * p;
+  double c = n * p + 0.5;
+  double vr = 0.92 - 4.2 / b;
+  double alpha = (2.83 + 5.1 / b) * spq;
+  double lpq = log(p / q);
+  int m = (int)floor((n + 1) * p);
+  double h = lgamma(m + 1.0) + lgamma(n - m + 1.0);
+
+  for (;;) {
+    double u = uniform() - 0.5;
+    double v = uniform();
+    double us = 0.5 - fabs(u);
+    int k = (int)floor((2.0 * a / us + b) * u + c);
+    if (k < 0 || k > n || v <= 0.0) { continue; }
+    if (us >= 0.07 && v <= vr) { return k; }
+
+    v = log(v * alpha / (a / (us * us) + b));
+    if (v <= h - lgamma(k + 1.0) - lgamma(n - k + 1.0) + (k - m) * lpq) {
+      return k;
+    }
+  }
+}
+
+int binomial(int n, double p) {
+  if (n <= 0 || p <= 0.0) { return 0; }
+  if (p >= 1.0) { return n; }
+  if (p > 0.5) { return n - binomial(n, 1.0 - p); }
+
+  if (n * p < 10.0) {
+    return binomialInversion(n, p);
+  }
+  return binomialBtrs(n, p);
+}
+
+// Draws the outcome counts one at a time: given that the first j outcomes
+// took some of the trials, each remaining trial lands on outcome j with
+// probability 1/(k - j).
+void multinomial(int n, int k, int* counts) {
+  for (int j = 0; j < k - 1; j++) {
+    counts[j] = binomial(n, 1.0 / (k - j));
+    n -= counts[j];
+  }
+  counts[k - 1] = n;
 }
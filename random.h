@@ -1,7 +1,18 @@
 #ifndef tvm_random_h
 #define tvm_random_h
 
+#include "common.h"
+
+uint64_t entropySeed(void); // a seed that differs from run to run
+uint64_t random64(void); // 64 random bits from the current generator
+void seekRandom(uint64_t seed, uint64_t stream, uint64_t sample); // for the calling thread
+bool selectGenerator(const char* name); // "xoshiro" (the default), "pcg" or "philox"
+bool selectSampler(const char* name); // "random" (the default), "antithetic", "stratified" or "sobol"
+
 int randomi(int upper); // random integer beteen 0 and upper-1
-double uniform(void); // uniform random number in range (0, 1)
+double uniform(void); // uniform random number in range [0, 1)
+
+int binomial(int n, double p); // successes in n trials with probability p
+void multinomial(int n, int k, int* counts); // n trials over k equally likely outcomes
 
 #endif
@@ -28,7 +28,8 @@ typedef struct {
   int line;
 } Scanner;
 
-Scanner scanner;
+// Each thread scans with its own, so that threads can compile at once.
+static _Thread_local Scanner scanner;
 
 void initScanner(const char* source) {
   scanner.start = source;
@@ -0,0 +1,577 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "pool.h"
+#include "server.h"
+#include "totals.h"
+#include "vm.h"
+
+#define REQUEST_HEADER_SIZE 32
+#define RESPONSE_HEADER_SIZE 24
+#define ID_SIZE 16
+
+// A longer request closes the connection.
+#define REQUEST_MAX (1 << 24)
+
+// Once this much output is waiting for a client, or this many of its
+// requests are, no more of its requests are started until it catches up.
+#define OUTPUT_HIGH (1 << 22)
+#define REPLIES_MAX 256
+
+// Slots in the chunk table. When half of them are taken the table is
+// emptied; a client sending the id of a forgotten chunk is told so and
+// sends the source again.
+#define CHUNK_SLOTS 4096
+
+#define EVENTS_MAX 64
+#define READ_SIZE 65536
+
+// Bytes before start have been read, or sent.
+typedef struct {
+  uint8_t* bytes;
+  size_t start;
+  size_t count;
+  size_t capacity;
+} Bytes;
+
+// A compiled chunk, kept until neither the table nor any job needs it.
+typedef struct {
+  Chunk chunk;
+  Obj* objects;   // the chunk's constants
+  int users;
+} Program;
+
+typedef struct {
+  uint64_t id[2];
+  Program* program; // NULL for an empty slot
+} CachedChunk;
+
+typedef struct Connection Connection;
+
+// A request's place in line. Its response is sent once every request
+// before it on the connection has been answered.
+typedef struct Reply {
+  struct Reply* next;
+  Connection* connection;
+  Program* program; // while its job runs
+  uint64_t id[2];
+  bool done;
+  ServeStatus status;
+  char* text;
+  size_t size;
+} Reply;
+
+struct Connection {
+  int fd;          // -1 once the client is gone
+  Bytes in;
+  Bytes out;
+  uint32_t events; // what epoll is watching for
+  bool closed;     // nothing more will be read
+  Reply* first;
+  Reply* last;
+  int replies;
+  Connection* nextUpdate; // on the list of connections jobs finished for
+  bool listed;
+};
+
+static void abandon(Connection* connection);
+static void acceptConnections(int listener);
+static void collectJobs(void);
+static CachedChunk* compileRequest(const uint8_t* source, size_t length, ServeStatus* status);
+static CachedChunk* findChunk(const uint64_t id[2]);
+static void forgetChunks(void);
+static void freeConnection(Connection* connection);
+static int listenOn(const char* path);
+static uint64_t loadU64(const uint8_t* bytes);
+static void put(Bytes* bytes, const void* data, size_t n);
+static void readInput(Connection* connection);
+static void releaseProgram(Program* program);
+static void reserve(Bytes* bytes, size_t n);
+static void sendReplies(Connection* connection);
+static void serveConnection(Connection* connection, uint32_t events);
+static void startRequest(Connection* connection, const uint8_t* request, uint32_t length);
+static bool startRequests(Connection* connection);
+static void storeU64(uint8_t* bytes, uint64_t n);
+static void update(Connection* connection);
+static void watch(Connection* connection);
+static bool writeOutput(Connection* connection);
+
+static int epollFd;
+static int finishedFd; // the pool's signal
+static CachedChunk chunks[CHUNK_SLOTS];
+static int chunkCount = 0;
+
+// Where the compiler says what's wrong with a request.
+static FILE* errors;
+static char* errorBytes;
+static size_t errorSize;
+
+// A connection whose client has gone still has its replies finished, and
+// is freed after the last.
+static void abandon(Connection* connection) {
+  close(connection->fd);
+  connection->fd = -1;
+  connection->in.start = connection->in.count = 0;
+  connection->out.start = connection->out.count = 0;
+}
+
+static void acceptConnections(int listener) {
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) { return; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    Connection* connection = ALLOCATE(Connection, 1);
+    memset(connection, 0, sizeof(Connection));
+    connection->fd = fd;
+    connection->events = EPOLLIN;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      freeConnection(connection);
+    }
+  }
+}
+
+// Turns each finished job into its reply, then sends what can be sent on
+// each connection that got one.
+static void collectJobs() {
+  Connection* updates = NULL;
+  for (Job* job = finishedJobs(); job != NULL; ) {
+    Job* next = job->next;
+    Reply* reply = (Reply*)job->owner;
+    reply->status = job->error != NULL ? SERVE_RUNTIME_ERROR : SERVE_OK;
+    if (job->error != NULL) {
+      reply->text = job->error;
+      reply->size = strlen(job->error);
+      job->error = NULL;
+    } else if (job->sink == SINK_OUTPUT) {
+      reply->text = job->text;
+      reply->size = job->textSize;
+      job->text = NULL;
+    } else {
+      FILE* text = open_memstream(&reply->text, &reply->size);
+      if (text == NULL) { failAllocation(); }
+      printTotals(text, &job->totals, job->sink, 0);
+      fclose(text);
+    }
+    reply->done = true;
+    freeJob(job);
+    releaseProgram(reply->program);
+    reply->program = NULL;
+
+    Connection* connection = reply->connection;
+    if (!connection->listed) {
+      connection->listed = true;
+      connection->nextUpdate = updates;
+      updates = connection;
+    }
+    job = next;
+  }
+
+  while (updates != NULL) {
+    Connection* connection = updates;
+    updates = connection->nextUpdate;
+    connection->listed = false;
+    update(connection);
+  }
+}
+
+// The chunk for source, compiled unless it's in the table already.
+static CachedChunk* compileRequest(const uint8_t* source, size_t length, ServeStatus* status) {
+  uint64_t id[2];
+  hashSource((const char*)source, length, id);
+  CachedChunk* cached = findChunk(id);
+  if (cached->program != NULL) { return cached; }
+  if (chunkCount >= CHUNK_SLOTS / 2) {
+    forgetChunks();
+    cached = findChunk(id);
+  }
+
+  // The scanner wants a terminated string.
+  char* terminated = ALLOCATE(char, length + 1);
+  memcpy(terminated, source, length);
+  terminated[length] = '\0';
+  Program* program = ALLOCATE(Program, 1);
+  initChunk(&program->chunk);
+  Obj* mark = objectMark();
+  bool compiled = compile(terminated, &program->chunk, errors);
+  FREE_ARRAY(char, terminated, length + 1);
+  if (!compiled) {
+    freeChunk(&program->chunk);
+    FREE(Program, program);
+    freeObjectsSince(mark);
+    *status = SERVE_COMPILE_ERROR;
+    return NULL;
+  }
+
+  program->objects = takeObjectsSince(mark);
+  program->users = 1;
+  cached->id[0] = id[0];
+  cached->id[1] = id[1];
+  cached->program = program;
+  chunkCount++;
+  return cached;
+}
+
+// The chunk's slot, or the empty one where it would go.
+static CachedChunk* findChunk(const uint64_t id[2]) {
+  uint32_t index = (uint32_t)id[0] & (CHUNK_SLOTS - 1);
+  for (;;) {
+    CachedChunk* cached = &chunks[index];
+    if (cached->program == NULL || (cached->id[0] == id[0] && cached->id[1] == id[1])) {
+      return cached;
+    }
+    index = (index + 1) & (CHUNK_SLOTS - 1);
+  }
+}
+
+// Programs still running are freed when their last job finishes.
+static void forgetChunks() {
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    if (chunks[i].program != NULL) {
+      releaseProgram(chunks[i].program);
+      chunks[i].program = NULL;
+    }
+  }
+  chunkCount = 0;
+}
+
+static void freeConnection(Connection* connection) {
+  FREE_ARRAY(uint8_t, connection->in.bytes, connection->in.capacity);
+  FREE_ARRAY(uint8_t, connection->out.bytes, connection->out.capacity);
+  FREE(Connection, connection);
+}
+
+// A socket left behind by an earlier server is replaced; any other file
+// is left alone.
+static int listenOn(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long.\n", path);
+    exit(74);
+  }
+  strcpy(address.sun_path, path);
+
+  struct stat status;
+  if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+    unlink(path);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    fprintf(stderr, "Could not listen on '%s'.\n", path);
+    exit(74);
+  }
+  return fd;
+}
+
+static uint64_t loadU64(const uint8_t* bytes) {
+  uint64_t n = 0;
+  for (int i = 7; i >= 0; i--) {
+    n = n << 8 | bytes[i];
+  }
+  return n;
+}
+
+static void put(Bytes* bytes, const void* data, size_t n) {
+  reserve(bytes, n);
+  memcpy(bytes->bytes + bytes->count, data, n);
+  bytes->count += n;
+}
+
+// Reads whatever the client has sent, up to a little more than the
+// longest request.
+static void readInput(Connection* connection) {
+  Bytes* in = &connection->in;
+  while (!connection->closed && in->count - in->start <= REQUEST_MAX) {
+    reserve(in, READ_SIZE);
+    ssize_t n = read(connection->fd, in->bytes + in->count, in->capacity - in->count);
+    if (n > 0) {
+      in->count += (size_t)n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      connection->closed = true;
+    }
+  }
+}
+
+static void releaseProgram(Program* program) {
+  if (--program->users > 0) { return; }
+
+  freeChunk(&program->chunk);
+  freeObjectList(program->objects);
+  FREE(Program, program);
+}
+
+static void reserve(Bytes* bytes, size_t n) {
+  if (bytes->count + n <= bytes->capacity) { return; }
+
+  size_t capacity = GROW_CAPACITY(bytes->capacity);
+  while (capacity < bytes->count + n) {
+    capacity *= 2;
+  }
+  bytes->bytes = GROW_ARRAY(uint8_t, bytes->bytes, bytes->capacity, capacity);
+  bytes->capacity = capacity;
+}
+
+// Queues the responses at the head of the line that are ready; a client
+// that's gone gets nothing.
+static void sendReplies(Connection* connection) {
+  static const char tooLong[] = "Too many results for one response; ask for fewer samples.\n";
+  while (connection->first != NULL && connection->first->done) {
+    Reply* reply = connection->first;
+    const char* text = reply->text;
+    size_t size = reply->size;
+    ServeStatus status = reply->status;
+    if (size > UINT32_MAX - RESPONSE_HEADER_SIZE) {
+      text = tooLong;
+      size = sizeof(tooLong) - 1;
+      status = SERVE_BAD_REQUEST;
+    }
+
+    if (connection->fd >= 0) {
+      uint8_t header[4 + RESPONSE_HEADER_SIZE] = { 0 };
+      uint32_t total = (uint32_t)(RESPONSE_HEADER_SIZE + size);
+      for (int i = 0; i < 4; i++) {
+        header[i] = (uint8_t)(total >> (8 * i));
+      }
+      header[4] = (uint8_t)status;
+      storeU64(header + 12, reply->id[0]);
+      storeU64(header + 20, reply->id[1]);
+      put(&connection->out, header, sizeof(header));
+      put(&connection->out, text, size);
+    }
+
+    connection->first = reply->next;
+    if (connection->first == NULL) {
+      connection->last = NULL;
+    }
+    connection->replies--;
+    free(reply->text);
+    FREE(Reply, reply);
+  }
+}
+
+// The main thread reads, compiles and writes; the pool's workers run the
+// samples.
+void serve(const char* path, int workers, PoolSampling poolSampling) {
+  int listener = listenOn(path);
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  errors = open_memstream(&errorBytes, &errorSize);
+  startPool(workers, poolSampling);
+  finishedFd = poolSignal();
+
+  // The pool's signal is told apart from connections by pointing at it.
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  struct epoll_event finished = { .events = EPOLLIN, .data.ptr = &finishedFd };
+  if (epollFd < 0 || errors == NULL ||
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event) != 0 ||
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, finishedFd, &finished) != 0) {
+    fprintf(stderr, "Could not listen on '%s'.\n", path);
+    exit(74);
+  }
+
+  // Finished jobs are collected after the connections' events, since
+  // that can free a connection with an event waiting.
+  struct epoll_event events[EVENTS_MAX];
+  for (;;) {
+    int n = epoll_wait(epollFd, events, EVENTS_MAX, -1);
+    bool collect = false;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        acceptConnections(listener);
+      } else if (events[i].data.ptr == &finishedFd) {
+        collect = true;
+      } else {
+        serveConnection((Connection*)events[i].data.ptr, events[i].events);
+      }
+    }
+    if (collect) {
+      collectJobs();
+    }
+  }
+}
+
+// A client that hangs up can't be answered.
+static void serveConnection(Connection* connection, uint32_t events) {
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    abandon(connection);
+  } else if (events & EPOLLIN) {
+    readInput(connection);
+  }
+  update(connection);
+}
+
+static void startRequest(Connection* connection, const uint8_t* request, uint32_t length) {
+  rewind(errors);
+  Reply* reply = ALLOCATE(Reply, 1);
+  memset(reply, 0, sizeof(Reply));
+  reply->connection = connection;
+  if (connection->last == NULL) {
+    connection->first = reply;
+  } else {
+    connection->last->next = reply;
+  }
+  connection->last = reply;
+  connection->replies++;
+
+  ServeStatus status = SERVE_BAD_REQUEST;
+  CachedChunk* cached = NULL;
+  uint8_t kind = length >= REQUEST_HEADER_SIZE ? request[0] : 0xff;
+  uint8_t mode = length >= REQUEST_HEADER_SIZE ? request[1] : 0xff;
+  uint64_t samples = length >= REQUEST_HEADER_SIZE ? loadU64(request + 8) : 0;
+  if (kind > 1 || mode > 2 ||
+      (kind == 1 && length != REQUEST_HEADER_SIZE + ID_SIZE)) {
+    fprintf(errors, "Malformed request.\n");
+  } else if (mode == 0 && samples > UINT32_MAX / 2) {
+    fprintf(errors, "Too many results for one response; ask for fewer samples.\n");
+  } else if (kind == 0) {
+    cached = compileRequest(request + REQUEST_HEADER_SIZE, length - REQUEST_HEADER_SIZE, &status);
+  } else {
+    uint64_t id[2] = { loadU64(request + REQUEST_HEADER_SIZE), loadU64(request + REQUEST_HEADER_SIZE + 8) };
+    cached = findChunk(id);
+    if (cached->program == NULL) {
+      fprintf(errors, "No chunk has that id; send its source.\n");
+      status = SERVE_UNKNOWN_CHUNK;
+      cached = NULL;
+    }
+  }
+
+  if (cached == NULL) {
+    fflush(errors);
+    reply->size = (size_t)ftell(errors);
+    reply->text = ALLOCATE(char, reply->size + 1);
+    memcpy(reply->text, errorBytes, reply->size);
+    reply->status = status;
+    reply->done = true;
+    return;
+  }
+
+  reply->id[0] = cached->id[0];
+  reply->id[1] = cached->id[1];
+  reply->program = cached->program;
+  reply->program->users++;
+  Sink sink = mode == 0 ? SINK_OUTPUT : mode == 1 ? SINK_HISTOGRAM : SINK_STATISTICS;
+  submitJob(newJob(&reply->program->chunk, sink, samples, loadU64(request + 16),
+                   loadU64(request + 24), reply));
+}
+
+// Starts every complete request waiting, unless the client has fallen
+// too far behind reading the answers. Whether it started any.
+static bool startRequests(Connection* connection) {
+  Bytes* in = &connection->in;
+  bool started = false;
+  while (connection->replies < REPLIES_MAX &&
+         connection->out.count - connection->out.start < OUTPUT_HIGH &&
+         in->count - in->start >= 4) {
+    const uint8_t* next = in->bytes + in->start;
+    uint32_t length = (uint32_t)next[0] | (uint32_t)next[1] << 8 |
+                      (uint32_t)next[2] << 16 | (uint32_t)next[3] << 24;
+    if (length > REQUEST_MAX) {
+      connection->closed = true;
+      in->start = in->count;
+      break;
+    }
+    if (in->count - in->start < 4 + (size_t)length) { break; }
+
+    startRequest(connection, next + 4, length);
+    in->start += 4 + (size_t)length;
+    started = true;
+  }
+
+  if (in->start == in->count) {
+    in->start = in->count = 0;
+  } else if (in->start > 0) {
+    memmove(in->bytes, in->bytes + in->start, in->count - in->start);
+    in->count -= in->start;
+    in->start = 0;
+  }
+  return started;
+}
+
+static void storeU64(uint8_t* bytes, uint64_t n) {
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t)(n >> (8 * i));
+  }
+}
+
+// Starts what requests it can and sends what answers are ready, until
+// neither makes room for more. A connection is closed once the client
+// has stopped sending and has every answer, or if it can't be written
+// to, and freed once no job still has a reply for it.
+static void update(Connection* connection) {
+  for (;;) {
+    int replies = connection->replies;
+    sendReplies(connection);
+    bool full = connection->out.count - connection->out.start >= OUTPUT_HIGH;
+    if (connection->fd >= 0 && !writeOutput(connection)) {
+      abandon(connection);
+    }
+    bool drained = full && connection->out.count - connection->out.start < OUTPUT_HIGH;
+    bool started = connection->fd >= 0 && startRequests(connection);
+    if (connection->fd < 0 || (!started && !drained && connection->replies == replies)) { break; }
+  }
+
+  if (connection->fd >= 0 && connection->closed && connection->first == NULL &&
+      connection->out.count == connection->out.start) {
+    abandon(connection);
+  }
+  if (connection->fd < 0) {
+    if (connection->first == NULL) {
+      freeConnection(connection);
+    }
+    return;
+  }
+  watch(connection);
+}
+
+// Reading stops while too many answers are waiting, and writing is only
+// waited for while some are.
+static void watch(Connection* connection) {
+  size_t waiting = connection->out.count - connection->out.start;
+  bool reading = !connection->closed && waiting < OUTPUT_HIGH && connection->replies < REPLIES_MAX;
+  uint32_t events = (reading ? EPOLLIN : 0) | (waiting > 0 ? EPOLLOUT : 0);
+  if (events != connection->events) {
+    struct epoll_event event = { .events = events, .data.ptr = connection };
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->events = events;
+  }
+}
+
+static bool writeOutput(Connection* connection) {
+  Bytes* out = &connection->out;
+  while (out->start < out->count) {
+    ssize_t n = send(connection->fd, out->bytes + out->start, out->count - out->start, MSG_NOSIGNAL);
+    if (n > 0) {
+      out->start += (size_t)n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    } else {
+      return false;
+    }
+  }
+  out->start = out->count = 0;
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef tvm_server_h
+#define tvm_server_h
+
+#include "vm.h"
+
+// tvm --serve: one long-running tvm answering requests on a Unix domain
+// socket, so that a roll costs a round trip instead of starting a
+// process. Compiled chunks stay in memory, found by the first 128 bits
+// of their source's SHA-256 (as hashSource gives them, two u64s); that
+// is the chunk's id, and once a client has the id it can send that in
+// place of the source. Nobody can find a source whose id names someone
+// else's chunk.
+//
+// Every message is a u32 length and then that many bytes, with every
+// number little endian. A request is
+//
+//   u8 kind       0: source follows; 1: a chunk id follows
+//   u8 mode       0: every result; 1: --distribution; 2: --stats
+//   6 zero bytes
+//   u64 samples
+//   u64 seed
+//   u64 stream
+//   the source, or the 16-byte chunk id
+//
+// and its response is
+//
+//   u8 status     a ServeStatus
+//   7 zero bytes
+//   16 bytes      the chunk id, or zeros if there's no chunk
+//   text          what tvm prints for the same options, or why it failed
+//
+// A client may send any number of requests without waiting; responses
+// come back in the order of the requests, though later ones may have been
+// worked on first.
+
+typedef enum {
+  SERVE_OK,
+  SERVE_COMPILE_ERROR,
+  SERVE_RUNTIME_ERROR,
+  SERVE_BAD_REQUEST,
+  SERVE_UNKNOWN_CHUNK // not compiled here yet, or forgotten; send the source
+} ServeStatus;
+
+// Runs samples on the given number of worker threads (see pool.h). Never
+// returns. Exits with 74 if it can't listen on the socket.
+void serve(const char* path, int workers, PoolSampling poolSampling);
+
+#endif
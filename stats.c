@@ -0,0 +1,255 @@
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "stats.h"
+
+typedef struct {
+  int value;
+  uint64_t weight;
+} Weighted;
+
+static void addMoment(Moments* moments, double x);
+static void addToSketch(Sketch* sketch, int value);
+static void compactLevel(Sketch* sketch, int level);
+static void compress(Sketch* sketch);
+static void growSketch(Sketch* sketch);
+static int levelCapacity(const Sketch* sketch, int level);
+static void mergeMoments(Moments* to, const Moments* from);
+static void mergeSketch(Sketch* to, const Sketch* from);
+static void pushValues(Sketch* sketch, int level, const int* values, int n);
+
+static void addMoment(Moments* moments, double x) {
+  double n1 = moments->n;
+  double n = ++moments->n;
+  double delta = x - moments->mean;
+  double deltaN = delta / n;
+  double deltaN2 = deltaN * deltaN;
+  double term = delta * deltaN * n1;
+
+  moments->mean += deltaN;
+  moments->m4 += term * deltaN2 * (n * n - 3 * n + 3) + 6 * deltaN2 * moments->m2 - 4 * deltaN * moments->m3;
+  moments->m3 += term * deltaN * (n - 2) - 3 * deltaN * moments->m2;
+  moments->m2 += term;
+}
+
+void addStatistic(Statistics* statistics, int value) {
+  addMoment(&statistics->moments, value);
+  addToSketch(&statistics->sketch, value);
+  if (value < statistics->min) { statistics->min = value; }
+  if (value > statistics->max) { statistics->max = value; }
+}
+
+static void addToSketch(Sketch* sketch, int value) {
+  pushValues(sketch, 0, &value, 1);
+  if (sketch->size >= sketch->limit) {
+    compress(sketch);
+  }
+}
+
+static int compareInts(const void* a, const void* b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+static int compareWeighted(const void* a, const void* b) {
+  int x = ((const Weighted*)a)->value;
+  int y = ((const Weighted*)b)->value;
+  return (x > y) - (x < y);
+}
+
+// Sorts the level and moves every other value up, starting at a random
+// one of the first two so neither end is favoured. With an odd count the
+// smallest value stays behind.
+static void compactLevel(Sketch* sketch, int level) {
+  int* values = sketch->values[level];
+  int n = sketch->count[level];
+  qsort(values, n, sizeof(int), compareInts);
+
+  sketch->coin ^= sketch->coin << 13;
+  sketch->coin ^= sketch->coin >> 7;
+  sketch->coin ^= sketch->coin << 17;
+
+  int kept = n & 1;
+  int moved = 0;
+  for (int i = kept + (int)(sketch->coin & 1); i < n; i += 2) {
+    values[kept + moved++] = values[i];
+  }
+  sketch->count[level] = kept;
+  sketch->size -= n - kept;
+  pushValues(sketch, level + 1, values + kept, moved);
+}
+
+// Compacts the lowest level that's full, adding a level on top if need be.
+static void compress(Sketch* sketch) {
+  for (int level = 0; level < sketch->levels; level++) {
+    if (sketch->count[level] >= levelCapacity(sketch, level)) {
+      if (level + 1 == sketch->levels) {
+        growSketch(sketch);
+      }
+      compactLevel(sketch, level);
+      return;
+    }
+  }
+}
+
+void freeStatistics(Statistics* statistics) {
+  Sketch* sketch = &statistics->sketch;
+  for (int level = 0; level < SKETCH_LEVELS; level++) {
+    FREE_ARRAY(int, sketch->values[level], sketch->capacity[level]);
+  }
+  initStatistics(statistics);
+}
+
+static void growSketch(Sketch* sketch) {
+  if (sketch->levels == SKETCH_LEVELS) { return; }
+
+  sketch->levels++;
+  sketch->limit = 0;
+  for (int level = 0; level < sketch->levels; level++) {
+    sketch->limit += levelCapacity(sketch, level);
+  }
+}
+
+void initStatistics(Statistics* statistics) {
+  statistics->moments = (Moments){ 0, 0, 0, 0, 0 };
+  statistics->min = INT_MAX;
+  statistics->max = INT_MIN;
+
+  Sketch* sketch = &statistics->sketch;
+  sketch->levels = 0;
+  sketch->size = 0;
+  sketch->coin = 0x9e3779b97f4a7c15;
+  for (int level = 0; level < SKETCH_LEVELS; level++) {
+    sketch->count[level] = 0;
+    sketch->capacity[level] = 0;
+    sketch->values[level] = NULL;
+  }
+  growSketch(sketch);
+}
+
+// Levels shrink by 2/3 going down from the top, so most of the sketch is
+// in the few highest levels.
+static int levelCapacity(const Sketch* sketch, int level) {
+  int depth = sketch->levels - level - 1;
+  return (int)ceil(SKETCH_K * pow(2.0 / 3.0, depth)) + 1;
+}
+
+static void mergeMoments(Moments* to, const Moments* from) {
+  if (from->n == 0) { return; }
+  if (to->n == 0) {
+    *to = *from;
+    return;
+  }
+
+  double a = to->n;
+  double b = from->n;
+  double n = a + b;
+  double delta = from->mean - to->mean;
+  double delta2 = delta * delta;
+
+  to->m4 += from->m4 + delta2 * delta2 * a * b * (a * a - a * b + b * b) / (n * n * n)
+          + 6 * delta2 * (a * a * from->m2 + b * b * to->m2) / (n * n)
+          + 4 * delta * (a * from->m3 - b * to->m3) / n;
+  to->m3 += from->m3 + delta2 * delta * a * b * (a - b) / (n * n)
+          + 3 * delta * (a * from->m2 - b * to->m2) / n;
+  to->m2 += from->m2 + delta2 * a * b / n;
+  to->mean += delta * b / n;
+  to->n += from->n;
+}
+
+static void mergeSketch(Sketch* to, const Sketch* from) {
+  while (to->levels < from->levels) {
+    growSketch(to);
+  }
+  for (int level = 0; level < from->levels; level++) {
+    pushValues(to, level, from->values[level], from->count[level]);
+  }
+  while (to->size >= to->limit) {
+    compress(to);
+  }
+}
+
+void mergeStatistics(Statistics* to, const Statistics* from) {
+  mergeMoments(&to->moments, &from->moments);
+  mergeSketch(&to->sketch, &from->sketch);
+  if (from->min < to->min) { to->min = from->min; }
+  if (from->max > to->max) { to->max = from->max; }
+}
+
+void printStatistics(FILE* file, const Statistics* statistics) {
+  static const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95, 0.99 };
+  const Moments* moments = &statistics->moments;
+
+  fprintf(file, "Samples = %llu\n", (unsigned long long)moments->n);
+  if (moments->n == 0) { return; }
+
+  fprintf(file, "Mean = %.6f\n", moments->mean);
+  if (moments->n > 1) {
+    double variance = moments->m2 / (moments->n - 1);
+    fprintf(file, "Variance = %.6f\n", variance);
+    fprintf(file, "Standard deviation = %.6f\n", sqrt(variance));
+  }
+  // Skewness and (excess) kurtosis aren't defined for constant results.
+  if (moments->m2 > 0) {
+    fprintf(file, "Skewness = %.6f\n", sqrt((double)moments->n) * moments->m3 / pow(moments->m2, 1.5));
+    fprintf(file, "Kurtosis = %.6f\n", moments->n * moments->m4 / (moments->m2 * moments->m2) - 3);
+  }
+  fprintf(file, "Minimum = %d\n", statistics->min);
+  fprintf(file, "Maximum = %d\n", statistics->max);
+
+  fprintf(file, "%11s  %s\n", "Quantile", "Value");
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    fprintf(file, "%10g%%  %d\n", quantiles[i] * 100, quantile(&statistics->sketch, quantiles[i]));
+  }
+}
+
+static void pushValues(Sketch* sketch, int level, const int* values, int n) {
+  if (sketch->count[level] + n > sketch->capacity[level]) {
+    int oldCapacity = sketch->capacity[level];
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while (capacity < sketch->count[level] + n) {
+      capacity *= 2;
+    }
+    sketch->values[level] = GROW_ARRAY(int, sketch->values[level], oldCapacity, capacity);
+    sketch->capacity[level] = capacity;
+  }
+
+  int* to = sketch->values[level] + sketch->count[level];
+  for (int i = 0; i < n; i++) {
+    to[i] = values[i];
+  }
+  sketch->count[level] += n;
+  sketch->size += n;
+}
+
+int quantile(const Sketch* sketch, double q) {
+  if (sketch->size == 0) { return 0; }
+
+  Weighted* all = ALLOCATE(Weighted, sketch->size);
+  int n = 0;
+  uint64_t total = 0;
+  for (int level = 0; level < sketch->levels; level++) {
+    for (int i = 0; i < sketch->count[level]; i++) {
+      all[n++] = (Weighted){ sketch->values[level][i], (uint64_t)1 << level };
+      total += (uint64_t)1 << level;
+    }
+  }
+  qsort(all, n, sizeof(Weighted), compareWeighted);
+
+  double target = q * total;
+  uint64_t seen = 0;
+  int value = all[n - 1].value;
+  for (int i = 0; i < n; i++) {
+    seen += all[i].weight;
+    if (seen >= target) {
+      value = all[i].value;
+      break;
+    }
+  }
+
+  FREE_ARRAY(Weighted, all, sketch->size);
+  return value;
+}
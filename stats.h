@@ -0,0 +1,57 @@
+#ifndef tvm_stats_h
+#define tvm_stats_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Summary statistics over integer results in (nearly) constant memory,
+// for when the results are too spread out for a histogram. Each sampling
+// thread keeps its own and they're merged at the end.
+
+// Central moments, updated one value at a time (Welford) and merged
+// pairwise (Pébay).
+typedef struct {
+  uint64_t n;
+  double mean;
+  double m2;
+  double m3;
+  double m4;
+} Moments;
+
+// KLL quantile sketch: level h holds values that each stand for 2^h
+// samples. When a level fills up it's sorted and every other value moves
+// up a level. With SKETCH_K = 200, ranks are within about 1% and the
+// sketch holds a few hundred values however many samples go in.
+#define SKETCH_K 200
+#define SKETCH_LEVELS 64
+
+typedef struct {
+  int levels;
+  int size; // values held, over all levels
+  int limit; // compact when size reaches this
+  uint64_t coin;
+  int count[SKETCH_LEVELS];
+  int capacity[SKETCH_LEVELS];
+  int* values[SKETCH_LEVELS];
+} Sketch;
+
+// Aligned so that threads' statistics never share a cache line.
+typedef struct {
+  _Alignas(CACHE_LINE) Moments moments;
+  Sketch sketch;
+  int min;
+  int max;
+} Statistics;
+
+void initStatistics(Statistics* statistics);
+void freeStatistics(Statistics* statistics);
+void addStatistic(Statistics* statistics, int value);
+void mergeStatistics(Statistics* to, const Statistics* from);
+
+// The smallest value v with at least a fraction q of samples <= v.
+int quantile(const Sketch* sketch, double q);
+
+void printStatistics(FILE* file, const Statistics* statistics);
+
+#endif
@@ -0,0 +1,76 @@
+#include "object.h"
+#include "totals.h"
+
+void freeTotals(Totals* totals) {
+  freeHistogram(&totals->histogram);
+  freeMultisets(&totals->multisets);
+  freeStatistics(&totals->statistics);
+}
+
+void initTotals(Totals* totals) {
+  initHistogram(&totals->histogram);
+  initMultisets(&totals->multisets);
+  initStatistics(&totals->statistics);
+}
+
+void mergeTotals(Totals* to, const Totals* from, Sink sink) {
+  switch (sink) {
+  case SINK_OUTPUT: break;
+  case SINK_HISTOGRAM:
+    mergeHistogram(&to->histogram, &from->histogram);
+    mergeMultisets(&to->multisets, &from->multisets);
+    break;
+  case SINK_STATISTICS: mergeStatistics(&to->statistics, &from->statistics); break;
+  }
+}
+
+void printTotals(FILE* file, const Totals* totals, Sink sink, double z) {
+  if (sink == SINK_STATISTICS) {
+    printStatistics(file, &totals->statistics);
+    return;
+  }
+  if (totals->histogram.samples > 0 || totals->multisets.samples == 0) {
+    printHistogram(file, &totals->histogram, z);
+  }
+  if (totals->multisets.samples > 0) {
+    printMultisets(file, &totals->multisets, z);
+  }
+}
+
+bool tallyResult(Totals* totals, Sink sink, Value result, uint64_t sample, FILE* errors) {
+  if (sink == SINK_HISTOGRAM && IS_INTEGER(result)) {
+    addOutcome(&totals->histogram, AS_INTEGER(result));
+  } else if (sink == SINK_HISTOGRAM && IS_COLLECTION(result)) {
+    addMultiset(&totals->multisets, AS_COLLECTION(result));
+  } else if (sink == SINK_STATISTICS && IS_INTEGER(result)) {
+    addStatistic(&totals->statistics, AS_INTEGER(result));
+  } else {
+    fprintf(errors, "Sample %llu can't be tallied; only %s results can be.\n",
+            (unsigned long long)sample,
+            sink == SINK_HISTOGRAM ? "integer and collection" : "integer");
+    return false;
+  }
+  return true;
+}
+
+uint64_t totalsNeeded(const Totals* totals, double z, double eps) {
+  uint64_t needed = 0;
+  if (totals->histogram.samples > 0) {
+    needed = samplesNeeded(&totals->histogram, z, eps);
+  }
+  if (totals->multisets.samples > 0 && multisetSamplesNeeded(&totals->multisets, z, eps) > needed) {
+    needed = multisetSamplesNeeded(&totals->multisets, z, eps);
+  }
+  return needed;
+}
+
+double totalsPrecision(const Totals* totals, double z) {
+  double widest = 0;
+  if (totals->histogram.samples > 0) {
+    widest = histogramPrecision(&totals->histogram, z);
+  }
+  if (totals->multisets.samples > 0 && multisetPrecision(&totals->multisets, z) > widest) {
+    widest = multisetPrecision(&totals->multisets, z);
+  }
+  return widest;
+}
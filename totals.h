@@ -0,0 +1,42 @@
+#ifndef tvm_totals_h
+#define tvm_totals_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "histogram.h"
+#include "multiset.h"
+#include "stats.h"
+#include "value.h"
+
+// Where results go.
+typedef enum {
+  SINK_OUTPUT,
+  SINK_HISTOGRAM,
+  SINK_STATISTICS
+} Sink;
+
+typedef struct {
+  Histogram histogram; // integer results
+  MultisetTable multisets; // collections
+  Statistics statistics;
+} Totals;
+
+void initTotals(Totals* totals);
+void freeTotals(Totals* totals);
+void mergeTotals(Totals* to, const Totals* from, Sink sink);
+
+// Adds result to the totals the sink keeps. False, after saying why on
+// errors, if it's a result that sink can't tally.
+bool tallyResult(Totals* totals, Sink sink, Value result, uint64_t sample, FILE* errors);
+
+// What tvm prints at the end for the sink, --distribution's tables or
+// --stats' summary.
+void printTotals(FILE* file, const Totals* totals, Sink sink, double z);
+
+// The widest half-interval over both kinds of result, and roughly how
+// many samples it'll take to get it down to eps.
+double totalsPrecision(const Totals* totals, double z);
+uint64_t totalsNeeded(const Totals* totals, double z, double eps);
+
+#endif
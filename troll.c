@@ -0,0 +1,249 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "histogram.h"
+#include "memory.h"
+#include "object.h"
+#include "troll.h"
+#include "vm.h"
+
+// Every entry point sets outOfMemory for the length of the call, so that
+// an allocation that fails unwinds to it rather than ending the process;
+// recover then frees whatever the call had started. Error messages and
+// results are written to memory streams that live as long as the Troll.
+struct Troll {
+  Histogram histogram; // first, for its alignment
+  Chunk chunk;
+  bool compiled;
+  Obj* objects;   // the chunk's constants, taken off the compiling thread's list
+  Obj* mark;      // while compiling
+  bool compiling;
+  bool running;   // whether the calling thread's VM is initialized
+  FILE* errors;
+  char* error;
+  size_t errorSize;
+  FILE* output;
+  char* text;
+  size_t textSize;
+  TrollOutcome* outcomes;
+  size_t outcomeCount;
+};
+
+static void begin(Troll* troll, jmp_buf* recovery);
+static TrollStatus finish(Troll* troll, TrollStatus status);
+static void forget(Troll* troll);
+static bool ready(Troll* troll);
+static TrollStatus recover(Troll* troll);
+static TrollStatus runSamples(Troll* troll, TrollRandom* random, uint64_t n,
+                              int* results, Histogram* histogram);
+static void startVM(Troll* troll, const TrollRandom* random);
+static void stopVM(Troll* troll);
+
+static void begin(Troll* troll, jmp_buf* recovery) {
+  rewind(troll->errors);
+  outOfMemory = recovery;
+}
+
+// Ends the error message so that trollError can return it.
+static TrollStatus finish(Troll* troll, TrollStatus status) {
+  outOfMemory = NULL;
+  fputc('\0', troll->errors);
+  fflush(troll->errors);
+  return status;
+}
+
+// Frees the compiled program, if there is one.
+static void forget(Troll* troll) {
+  freeChunk(&troll->chunk);
+  freeObjectList(troll->objects);
+  troll->objects = NULL;
+  troll->compiled = false;
+}
+
+// Whether troll has a program to run, saying so if not.
+static bool ready(Troll* troll) {
+  if (!troll->compiled) {
+    fprintf(troll->errors, "Nothing has been compiled.");
+  }
+  return troll->compiled;
+}
+
+// After an allocation failed: whatever the call was doing is abandoned.
+static TrollStatus recover(Troll* troll) {
+  outOfMemory = NULL;
+  if (troll->running) {
+    stopVM(troll);
+  }
+  if (troll->compiling) {
+    freeChunk(&troll->chunk);
+    freeObjectsSince(troll->mark);
+    troll->compiling = false;
+  }
+  freeHistogram(&troll->histogram);
+
+  rewind(troll->errors);
+  fputs("Out of memory.", troll->errors);
+  return finish(troll, TROLL_OUT_OF_MEMORY);
+}
+
+// Runs n samples from random, storing integer results in results or
+// adding them to histogram.
+static TrollStatus runSamples(Troll* troll, TrollRandom* random, uint64_t n,
+                              int* results, Histogram* histogram) {
+  startVM(troll, random);
+  TrollStatus status = TROLL_OK;
+  uint64_t done = 0;
+  for (; done < n && status == TROLL_OK; done++) {
+    Value result;
+    if (runSample(&troll->chunk, random->sample + done, &result) != INTERPRET_OK) {
+      status = TROLL_RUNTIME_ERROR;
+    } else if (!IS_INTEGER(result)) {
+      fprintf(troll->errors, "Sample %llu is not an integer.",
+              (unsigned long long)(random->sample + done));
+      status = TROLL_NOT_AN_INTEGER;
+    } else if (results != NULL) {
+      results[done] = AS_INTEGER(result);
+    } else {
+      addOutcome(histogram, AS_INTEGER(result));
+    }
+  }
+  stopVM(troll);
+  random->sample += done;
+  return status;
+}
+
+static void startVM(Troll* troll, const TrollRandom* random) {
+  initVM();
+  troll->running = true;
+  setErrors(troll->errors);
+  setSeed(random->seed);
+  setStream(random->stream);
+}
+
+static void stopVM(Troll* troll) {
+  freeVM();
+  troll->running = false;
+}
+
+TrollStatus trollCompile(Troll* troll, const char* source) {
+  jmp_buf recovery;
+  if (setjmp(recovery) != 0) { return recover(troll); }
+  begin(troll, &recovery);
+
+  forget(troll);
+  troll->mark = objectMark();
+  troll->compiling = true;
+  bool compiled = compile(source, &troll->chunk, troll->errors);
+  troll->compiling = false;
+  if (!compiled) {
+    freeChunk(&troll->chunk);
+    freeObjectsSince(troll->mark);
+    return finish(troll, TROLL_COMPILE_ERROR);
+  }
+
+  troll->objects = takeObjectsSince(troll->mark);
+  troll->compiled = true;
+  return finish(troll, TROLL_OK);
+}
+
+TrollStatus trollDistribution(Troll* troll, TrollRandom* random, uint64_t samples,
+                              const TrollOutcome** outcomes, size_t* count) {
+  jmp_buf recovery;
+  if (setjmp(recovery) != 0) { return recover(troll); }
+  begin(troll, &recovery);
+  if (!ready(troll)) { return finish(troll, TROLL_NOT_COMPILED); }
+
+  TrollStatus status = runSamples(troll, random, samples, NULL, &troll->histogram);
+  if (status == TROLL_OK) {
+    int n;
+    Outcome* seen = sortedOutcomes(&troll->histogram, &n);
+    free(troll->outcomes);
+    troll->outcomes = (TrollOutcome*)malloc((n > 0 ? n : 1) * sizeof(TrollOutcome));
+    if (troll->outcomes == NULL) {
+      FREE_ARRAY(Outcome, seen, n);
+      return recover(troll);
+    }
+    for (int i = 0; i < n; i++) {
+      troll->outcomes[i].value = seen[i].value;
+      troll->outcomes[i].probability = (double)seen[i].count / troll->histogram.samples;
+    }
+    troll->outcomeCount = n;
+    FREE_ARRAY(Outcome, seen, n);
+    *outcomes = troll->outcomes;
+    *count = troll->outcomeCount;
+  }
+  freeHistogram(&troll->histogram);
+  return finish(troll, status);
+}
+
+const char* trollError(Troll* troll) {
+  return troll->error;
+}
+
+TrollStatus trollEvaluate(Troll* troll, TrollRandom* random, const char** text) {
+  jmp_buf recovery;
+  if (setjmp(recovery) != 0) { return recover(troll); }
+  begin(troll, &recovery);
+  if (!ready(troll)) { return finish(troll, TROLL_NOT_COMPILED); }
+
+  startVM(troll, random);
+  Value result;
+  TrollStatus status = TROLL_RUNTIME_ERROR;
+  if (runSample(&troll->chunk, random->sample, &result) == INTERPRET_OK) {
+    rewind(troll->output);
+    fprintValue(troll->output, result);
+    fputc('\0', troll->output);
+    fflush(troll->output);
+    *text = troll->text;
+    status = TROLL_OK;
+  }
+  stopVM(troll);
+  random->sample++;
+  return finish(troll, status);
+}
+
+void trollFree(Troll* troll) {
+  if (troll == NULL) { return; }
+
+  forget(troll);
+  fclose(troll->errors);
+  fclose(troll->output);
+  free(troll->error);
+  free(troll->text);
+  free(troll->outcomes);
+  free(troll);
+}
+
+Troll* trollNew(void) {
+  Troll* troll = (Troll*)aligned_alloc(CACHE_LINE, sizeof(Troll));
+  if (troll == NULL) { return NULL; }
+  memset(troll, 0, sizeof(Troll));
+  initChunk(&troll->chunk);
+  initHistogram(&troll->histogram);
+
+  troll->errors = open_memstream(&troll->error, &troll->errorSize);
+  troll->output = open_memstream(&troll->text, &troll->textSize);
+  if (troll->errors == NULL || troll->output == NULL) {
+    if (troll->errors != NULL) { fclose(troll->errors); }
+    if (troll->output != NULL) { fclose(troll->output); }
+    free(troll->error);
+    free(troll->text);
+    free(troll);
+    return NULL;
+  }
+  finish(troll, TROLL_OK);
+  return troll;
+}
+
+TrollStatus trollSample(Troll* troll, TrollRandom* random, int* results, size_t n) {
+  jmp_buf recovery;
+  if (setjmp(recovery) != 0) { return recover(troll); }
+  begin(troll, &recovery);
+  if (!ready(troll)) { return finish(troll, TROLL_NOT_COMPILED); }
+
+  return finish(troll, runSamples(troll, random, n, results, NULL));
+}
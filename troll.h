@@ -0,0 +1,74 @@
+#ifndef tvm_troll_h
+#define tvm_troll_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libtroll: Troll inside another program. Compile a program from a
+// string once, then roll it as often as needed, in one of three ways:
+// one result as text, a buffer of integer results, or the distribution
+// of the results. Nothing here exits, reads or writes files, or prints;
+// every failure comes back as a TrollStatus, with a message from
+// trollError; a program that goes wrong while it's rolled, dividing by
+// zero or choosing from {}, gives TROLL_RUNTIME_ERROR.
+//
+// A Troll is used by one thread at a time. Different Trolls can be used
+// on different threads at once.
+
+#if defined(__GNUC__)
+#define TROLL_API __attribute__((visibility("default")))
+#else
+#define TROLL_API
+#endif
+
+typedef struct Troll Troll;
+
+typedef enum {
+  TROLL_OK,
+  TROLL_COMPILE_ERROR,
+  TROLL_RUNTIME_ERROR,
+  TROLL_NOT_AN_INTEGER, // a result trollSample or trollDistribution can't count
+  TROLL_NOT_COMPILED,
+  TROLL_OUT_OF_MEMORY
+} TrollStatus;
+
+// The random numbers for sample i of a stream under a seed are always the
+// same, as in tvm's --seed, --stream and --first. Calls that roll start
+// at sample and move it on past the samples they use, so passing the same
+// TrollRandom to call after call never repeats a sample.
+typedef struct {
+  uint64_t seed;
+  uint64_t stream;
+  uint64_t sample;
+} TrollRandom;
+
+typedef struct {
+  int value;
+  double probability;
+} TrollOutcome;
+
+// NULL if there isn't the memory for one.
+TROLL_API Troll* trollNew(void);
+TROLL_API void trollFree(Troll* troll);
+
+// Why the last call on troll failed, or "" if it didn't. Valid until the
+// next call.
+TROLL_API const char* trollError(Troll* troll);
+
+// Replaces troll's program with source's.
+TROLL_API TrollStatus trollCompile(Troll* troll, const char* source);
+
+// One result, printed the way tvm prints it, without a newline. *text is
+// valid until the next call on troll.
+TROLL_API TrollStatus trollEvaluate(Troll* troll, TrollRandom* random, const char** text);
+
+// n results into results; every one must be an integer.
+TROLL_API TrollStatus trollSample(Troll* troll, TrollRandom* random, int* results, size_t n);
+
+// The chance of each integer result, estimated from the given number of
+// samples, in increasing order of value. *outcomes is valid until the
+// next call on troll.
+TROLL_API TrollStatus trollDistribution(Troll* troll, TrollRandom* random, uint64_t samples,
+                                        const TrollOutcome** outcomes, size_t* count);
+
+#endif
@@ -36,31 +36,70 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
-static void compileFile(char* path) {
-  Chunk chunk;
-  initChunk(&chunk);
-  
+// Compiles the file into an empty chunk, or exits.
+static void compileSource(const char* path, Chunk* chunk) {
   char* source = readFile(path);
-
-  if (!compile(source, &chunk)) {
-    freeChunk(&chunk);
+  if (!compile(source, chunk, stderr)) {
+    freeChunk(chunk);
     free(source);
     exit(65);
   }
+  free(source);
+}
+
+// Each file becomes an entry named after it, less its directory and
+// extension.
+static void compileArchive(const char* archive, char* paths[], int count) {
+  Chunk* chunks = (Chunk*)malloc(count * sizeof(Chunk));
+  const char** names = (const char**)malloc(count * sizeof(char*));
+  for (int i = 0; i < count; i++) {
+    initChunk(&chunks[i]);
+    compileSource(paths[i], &chunks[i]);
+
+    char* name = strrchr(paths[i], '/') != NULL ? strrchr(paths[i], '/') + 1 : paths[i];
+    char* dot = strrchr(name, '.');
+    if (dot != NULL && dot != name) {
+      *dot = '\0';
+    }
+    names[i] = name;
+  }
+
+  ChunkStatus status = saveArchive(archive, chunks, names, count);
+
+  for (int i = 0; i < count; i++) {
+    freeChunk(&chunks[i]);
+  }
+  free(chunks);
+  free(names);
+  if (status != CHUNK_OK) {
+    exit(statusExitCode(status));
+  }
+}
+
+static void compileFile(char* path) {
+  Chunk chunk;
+  initChunk(&chunk);
+  compileSource(path, &chunk);
+
   // hack to change output file name; TODO: do this properly
   size_t n = strlen(path);
   path[n-1] = 'g';
-  saveChunk(&chunk, path);
+  ChunkStatus status = saveChunk(&chunk, path);
   
   freeChunk(&chunk);
-  free(source);
+  if (status != CHUNK_OK) {
+    exit(statusExitCode(status));
+  }
 }
 
 int main(int argc, char* argv[]) {
   if (argc == 2) {
     compileFile(argv[1]);
+  } else if (argc > 3 && strcmp(argv[1], "--archive") == 0) {
+    compileArchive(argv[2], argv + 3, argc - 3);
   } else {
-    fprintf(stderr, "usage: trollc <file>\n");
+    fprintf(stderr, "usage: trollc <file>\n"
+                    "       trollc --archive <archive> <file>...\n");
     exit(64);
   }
   return 0;
@@ -15,14 +15,18 @@ void initValueArray(ValueArray* array) {
   array->count = 0;
 }
 
-void printValue(Value value) {
+void fprintValue(FILE* file, Value value) {
   switch (value.type) {
-  case VAL_INTEGER: printf("%d", AS_INTEGER(value)); break;
-  case VAL_OBJ: printObject(value); break;
-  case VAL_REAL: printf("%g", AS_REAL(value)); break;
+  case VAL_INTEGER: fprintf(file, "%d", AS_INTEGER(value)); break;
+  case VAL_OBJ: fprintObject(file, value); break;
+  case VAL_REAL: fprintf(file, "%g", AS_REAL(value)); break;
   }
 }
 
+void printValue(Value value) {
+  fprintValue(stdout, value);
+}
+
 void writeValueArray(ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
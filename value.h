@@ -1,6 +1,8 @@
 #ifndef tvm_value_h
 #define tvm_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -43,6 +45,7 @@ typedef struct {
 
 void freeValueArray(ValueArray* array);
 void initValueArray(ValueArray* array);
+void fprintValue(FILE* file, Value value);
 void printValue(Value value);
 void writeValueArray(ValueArray* array, Value value);
 
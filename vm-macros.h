@@ -7,11 +7,25 @@
     CHECK_INTEGER(1, "Filter value must be an integer.");       \
     ObjCollection* c = AS_COLLECTION(pop());                    \
     int f = AS_INTEGER(pop());                                  \
-    ObjCollection* r = initCollection();                        \
-    for (int i = 0; i < c->count; i++) {                        \
-      if (f op c->ints[i]) {                                    \
-        addToCollection(r, c->ints[i]);                         \
+    ObjCollection* r;                                           \
+    if (IS_RANGE(c)) {                                          \
+      r = filterRange(c, op, f);                                \
+    } else if (IS_COUNTED(c)) {                                 \
+      r = ownCollection(c);                                     \
+      for (int i = 0; i < r->span; i++) {                       \
+        if (!filterAccepts(op, f, r->lo + i)) {                 \
+          r->count -= r->counts[i];                             \
+          r->counts[i] = 0;                                     \
+        }                                                       \
       }                                                         \
+    } else if (c->shared) {                                     \
+      r = initSizedCollection(c->count, c->width);              \
+      r->count = filterElements(op, f, c->width, c->elements,   \
+                                c->count, r->elements);         \
+    } else {                                                    \
+      r = c;                                                    \
+      r->count = filterElements(op, f, c->width, c->elements,   \
+                                c->count, c->elements);         \
     }                                                           \
     push(OBJ_VAL(r));                                           \
   } while(false)
@@ -25,6 +39,24 @@
     push(valueType(a op b)); \
   } while(false)
 
+// Dividing by zero, or INT_MIN by -1, would trap.
+#define DIVISION_OP(op) \
+  do { \
+    CHECK_INTEGER(0, "Operands to binary operator must be integers."); \
+    CHECK_INTEGER(1, "Operands to binary operator must be integers."); \
+    int b = AS_INTEGER(pop()); \
+    int a = AS_INTEGER(pop()); \
+    if (b == 0) { \
+      runtimeError("Division by zero."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    if (a == INT_MIN && b == -1) { \
+      runtimeError("Integer overflow in division."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    push(INTEGER_VAL(a op b)); \
+  } while(false)
+
 // TODO: ugh...actually implementing these is going to be fun...
 #define BINARY_STRING_OP(op) \
   do { \
@@ -79,6 +111,16 @@
 #define READ_SHORT() \
   (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
 
+#define READ_U24() \
+  (vm.ip += 3, (uint32_t)vm.ip[-3] << 16 | (uint32_t)vm.ip[-2] << 8 | vm.ip[-1])
+
+#define READ_U32() \
+  (vm.ip += 4, (uint32_t)vm.ip[-4] << 24 | (uint32_t)vm.ip[-3] << 16 | (uint32_t)vm.ip[-2] << 8 | vm.ip[-1])
+
+#define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_U24()])
+
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+
 #endif
@@ -1,24 +1,336 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "histogram.h"
+#include "memory.h"
+#include "random.h"
+#include "server.h"
+#include "totals.h"
 #include "vm.h"
 
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "usage: tvm <file>\n");
-    exit(64);
-  }
+// Adaptive sampling starts with this many samples and at most doubles the
+// total with each batch after that.
+#define FIRST_BATCH 1024
+
+static double parseFraction(const char* arg);
+static uint64_t parseCount(const char* arg);
+static void usage();
+
+// Samples are split into one contiguous block per thread. Since sample i
+// always draws the same random numbers, the output doesn't depend on the
+// number of threads; each block is buffered and printed (or tallied) in
+// order.
+typedef struct {
+  pthread_t thread;
+  uint64_t first;
+  uint64_t count;
+  char* output;
+  size_t size;
+  Totals totals;
+  InterpretResult status;
+  bool threaded; // false if no thread could be started and it ran in runBatch
+} Block;
 
-  Chunk* chunk = loadChunk(argv[1]);
+static Chunk* chunk;
+static PoolSampling poolSampling = POOLS_MULTINOMIAL;
+static uint64_t seed = 0;
+static uint64_t stream = 0;
+static Sink sink = SINK_OUTPUT;
+
+static InterpretResult runSamples(uint64_t first, uint64_t count, FILE* out, Totals* totals) {
   initVM();
+  setPoolSampling(poolSampling);
+  setSeed(seed);
+  setStream(stream);
+
+  InterpretResult status = INTERPRET_OK;
+  for (uint64_t i = 0; i < count && status == INTERPRET_OK; i++) {
+    Value result;
+    status = runSample(chunk, first + i, &result);
+    if (status != INTERPRET_OK) {
+      break;
+    }
+    if (sink == SINK_OUTPUT) {
+      fprintValue(out, result);
+      fputc('\n', out);
+    } else if (!tallyResult(totals, sink, result, first + i, stderr)) {
+      status = INTERPRET_RUNTIME_ERROR;
+    }
+  }
 
-  interpret(chunk);
-  
   freeVM();
+  return status;
+}
+
+static void* runBlock(void* arg) {
+  Block* block = (Block*)arg;
+  if (sink != SINK_OUTPUT) {
+    block->status = runSamples(block->first, block->count, NULL, &block->totals);
+    return NULL;
+  }
+
+  FILE* out = open_memstream(&block->output, &block->size);
+  if (out == NULL) {
+    fprintf(stderr, "Not enough memory to buffer samples.\n");
+    exit(74);
+  }
+  block->status = runSamples(block->first, block->count, out, NULL);
+  fclose(out);
+  return NULL;
+}
+
+// Runs samples first..first+count-1, printing them or adding them to
+// totals.
+static InterpretResult runBatch(uint64_t first, uint64_t count, uint64_t threads, Totals* totals) {
+  if (threads == 1) {
+    return runSamples(first, count, stdout, totals);
+  }
+
+  InterpretResult status = INTERPRET_OK;
+  Block* blocks = (Block*)allocateAligned(CACHE_LINE, threads * sizeof(Block));
+  memset(blocks, 0, threads * sizeof(Block));
+  for (uint64_t t = 0; t < threads; t++) {
+    blocks[t].first = first + count / threads * t + (t < count % threads ? t : count % threads);
+    blocks[t].count = count / threads + (t < count % threads);
+    initTotals(&blocks[t].totals);
+    blocks[t].threaded = pthread_create(&blocks[t].thread, NULL, runBlock, &blocks[t]) == 0;
+    if (!blocks[t].threaded) {
+      runBlock(&blocks[t]);
+    }
+  }
+  for (uint64_t t = 0; t < threads; t++) {
+    if (blocks[t].threaded) {
+      pthread_join(blocks[t].thread, NULL);
+    }
+    if (status == INTERPRET_OK) {
+      if (sink == SINK_OUTPUT) {
+        fwrite(blocks[t].output, 1, blocks[t].size, stdout);
+      } else {
+        mergeTotals(totals, &blocks[t].totals, sink);
+      }
+      status = blocks[t].status;
+    }
+    free(blocks[t].output);
+    freeTotals(&blocks[t].totals);
+  }
+  free(blocks);
+  return status;
+}
+
+// Samples in batches until the mean and the probability of every outcome
+// are known to within ±eps, or until the limit.
+static InterpretResult runUntilPrecise(uint64_t first, uint64_t limit, uint64_t threads,
+                                       double eps, double confidence) {
+  double z = normalWidth(confidence);
+  Totals totals;
+  initTotals(&totals);
+
+  InterpretResult status = INTERPRET_OK;
+  uint64_t done = 0;
+  uint64_t batch = FIRST_BATCH;
+  while (status == INTERPRET_OK && done < limit) {
+    if (batch > limit - done) {
+      batch = limit - done;
+    }
+    status = runBatch(first + done, batch, threads, &totals);
+    done += batch;
+    if (totalsPrecision(&totals, z) <= eps) {
+      break;
+    }
+
+    uint64_t needed = totalsNeeded(&totals, z, eps);
+    batch = needed > done ? needed - done : FIRST_BATCH;
+    if (batch < FIRST_BATCH) { batch = FIRST_BATCH; }
+    if (batch > done) { batch = done; }
+  }
+
+  if (status == INTERPRET_OK) {
+    printTotals(stdout, &totals, sink, z);
+    if (totalsPrecision(&totals, z) > eps) {
+      fprintf(stderr, "Stopped after %llu samples without reaching ±%g.\n",
+              (unsigned long long)done, eps);
+    }
+  }
+  freeTotals(&totals);
+  return status;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: tvm [--per-die] [--rng xoshiro|pcg|philox]\n"
+                  "           [--sampler random|antithetic|stratified|sobol]\n"
+                  "           [--seed n] [--stream n] [--first n] [--samples n] [--threads n]\n"
+                  "           [--distribution | --precision eps [--confidence p] | --stats]\n"
+                  "           <file> | <archive> <entry> | --serve <socket> | --batch [--null]\n");
+  exit(64);
+}
+
+int main(int argc, char* argv[]) {
+  bool seeded = false;
+  uint64_t first = 0;
+  uint64_t samples = 1;
+  bool limited = false;
+  uint64_t threads = 0;
+  double precision = 0;
+  double confidence = 0.95;
+  const char* socket = NULL;
+  bool batch = false;
+  char delimiter = '\n';
+  int arg = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "--per-die") == 0) {
+      poolSampling = POOLS_PER_DIE;
+    } else if (strcmp(argv[arg], "--rng") == 0 && arg + 1 < argc) {
+      if (!selectGenerator(argv[++arg])) {
+        usage();
+      }
+    } else if (strcmp(argv[arg], "--sampler") == 0 && arg + 1 < argc) {
+      if (!selectSampler(argv[++arg])) {
+        usage();
+      }
+    } else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc) {
+      seed = parseCount(argv[++arg]);
+      seeded = true;
+    } else if (strcmp(argv[arg], "--stream") == 0 && arg + 1 < argc) {
+      stream = parseCount(argv[++arg]);
+    } else if (strcmp(argv[arg], "--first") == 0 && arg + 1 < argc) {
+      first = parseCount(argv[++arg]);
+    } else if (strcmp(argv[arg], "--samples") == 0 && arg + 1 < argc) {
+      samples = parseCount(argv[++arg]);
+      limited = true;
+    } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+      threads = parseCount(argv[++arg]);
+      if (threads < 1) {
+        usage();
+      }
+    } else if (strcmp(argv[arg], "--distribution") == 0) {
+      sink = SINK_HISTOGRAM;
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      sink = SINK_STATISTICS;
+    } else if (strcmp(argv[arg], "--precision") == 0 && arg + 1 < argc) {
+      precision = parseFraction(argv[++arg]);
+    } else if (strcmp(argv[arg], "--confidence") == 0 && arg + 1 < argc) {
+      confidence = parseFraction(argv[++arg]);
+    } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+      socket = argv[++arg];
+    } else if (strcmp(argv[arg], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[arg], "--null") == 0) {
+      delimiter = '\0';
+    } else {
+      usage();
+    }
+  }
+  // Each request to a server brings its own seed, samples and output. A
+  // server or a batch uses every core unless told otherwise.
+  if (socket != NULL) {
+    if (arg != argc || threads > 1024 || batch) {
+      usage();
+    }
+    serve(socket, threads > 0 ? (int)threads : (int)sysconf(_SC_NPROCESSORS_ONLN), poolSampling);
+  }
+  if (delimiter == '\0' && !batch) {
+    usage();
+  }
+  if (batch) {
+    if (arg != argc || threads > 1024 || precision > 0) {
+      usage();
+    }
+    BatchOptions options = {
+      delimiter, sink, first, samples, seeded ? seed : entropySeed(), stream,
+      threads > 0 ? (int)threads : (int)sysconf(_SC_NPROCESSORS_ONLN), poolSampling
+    };
+    return evaluateBatch(&options);
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (arg < argc - 2 || arg > argc - 1 || threads > 1024 || (precision > 0 && sink != SINK_OUTPUT)) {
+    usage();
+  }
+
+  // An archive stays mapped while its entry runs. Source files (.t) are
+  // compiled, or found in the cache.
+  Archive* archive = NULL;
+  size_t length = strlen(argv[arg]);
+  ChunkStatus loaded = CHUNK_OK;
+  if (arg == argc - 2) {
+    loaded = openArchive(argv[arg], &archive);
+    if (loaded == CHUNK_OK) {
+      loaded = loadEntry(archive, argv[arg + 1], &chunk);
+    }
+  } else if (length > 2 && strcmp(argv[arg] + length - 2, ".t") == 0) {
+    chunk = compileCached(argv[arg]);
+  } else {
+    loaded = loadChunk(argv[arg], &chunk);
+  }
+  if (loaded != CHUNK_OK) {
+    exit(statusExitCode(loaded));
+  }
+  // The compiler rejects source needing more, so a .t file, cached or
+  // not, fails the same way whichever run it is; a chunk file may have
+  // been compiled by a tvm with a deeper stack.
+  if (chunk->stackDepth > STACK_MAX) {
+    fprintf(stderr, "'%s' needs a deeper stack than tvm has.\n", argv[argc - 1]);
+    exit(65);
+  }
+  if (!seeded) {
+    seed = entropySeed();
+  }
+
+  InterpretResult status;
+  if (precision > 0) {
+    sink = SINK_HISTOGRAM;
+    status = runUntilPrecise(first, limited ? samples : UINT64_MAX, threads, precision, confidence);
+  } else if (sink != SINK_OUTPUT) {
+    Totals totals;
+    initTotals(&totals);
+    status = runBatch(first, samples, threads, &totals);
+    if (status == INTERPRET_OK) {
+      printTotals(stdout, &totals, sink, 0);
+    }
+    freeTotals(&totals);
+  } else {
+    status = runBatch(first, samples, threads, NULL);
+  }
+
   freeChunk(chunk);
+  if (archive != NULL) {
+    closeArchive(archive);
+  }
 
-  return 0;
+  return status == INTERPRET_OK ? 0 : 70;
+}
+
+// A number strictly between 0 and 1.
+static double parseFraction(const char* arg) {
+  char* end;
+  double x = strtod(arg, &end);
+  if (*end != '\0' || end == arg || !(x > 0 && x < 1)) {
+    usage();
+  }
+  return x;
+}
+
+// strtoull would take "-1" as 2^64 - 1, so a sign is refused up front.
+static uint64_t parseCount(const char* arg) {
+  const char* digits = arg;
+  while (isspace((unsigned char)*digits)) { digits++; }
+  char* end;
+  errno = 0;
+  uint64_t n = strtoull(digits, &end, 0);
+  if (*digits == '-' || *digits == '+' || *end != '\0' || end == digits || errno == ERANGE) {
+    usage();
+  }
+  return n;
 }
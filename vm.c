@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -6,34 +7,88 @@
 
 #include "common.h"
 #include "debug.h"
+#include "kernels.h"
 #include "memory.h"
 #include "object.h"
 #include "random.h"
 #include "vm.h"
 #include "vm-macros.h"
 
+// Below this many dice per face, rolling each die is cheaper than drawing
+// the face counts from a multinomial distribution.
+#define MULTINOMIAL_DICE_PER_FACE 32
+
 static Value peek(int distance);
 static Value pop();
 static void push(Value value);
+static void endSample();
 static void resetStack();
+static void rollPool(ObjCollection* c, int ndice, int sides, int offset);
 static InterpretResult run();
 static void runtimeError(const char* format, ...);
 
-VM vm;
+// Each thread runs samples on a VM of its own.
+_Thread_local VM vm;
 
 void freeVM() {
+  if (vm.sampled) {
+    endSample();
+  }
   freeTable(&vm.globals);
 }
 
 void initVM() {
+  initKernels();
   resetStack();
   initTable(&vm.globals);
+  vm.poolSampling = POOLS_MULTINOMIAL;
+  vm.seed = 0;
+  vm.stream = 0;
+  vm.sampled = false;
+  vm.errors = stderr;
 }
 
-InterpretResult interpret(Chunk* chunk) {
+// Runs sample index of the VM's stream and stores its value in *result.
+// The value stays valid until the next call or freeVM, which free every
+// object allocated since the sample started.
+InterpretResult runSample(Chunk* chunk, uint64_t index, Value* result) {
+  if (vm.sampled) {
+    endSample();
+  }
+  vm.sampleMark = objectMark();
+  vm.sampled = true;
+  seekRandom(vm.seed, vm.stream, index);
+
   vm.chunk = chunk;
   vm.ip = vm.chunk->code;
-  return run();
+  resetStack();
+  InterpretResult status = run();
+  if (status == INTERPRET_OK) {
+    *result = pop();
+  }
+  return status;
+}
+
+void setErrors(FILE* errors) {
+  vm.errors = errors;
+}
+
+void setPoolSampling(PoolSampling sampling) {
+  vm.poolSampling = sampling;
+}
+
+void setSeed(uint64_t seed) {
+  vm.seed = seed;
+}
+
+void setStream(uint64_t stream) {
+  vm.stream = stream;
+}
+
+// Globals only live for one sample, like everything they refer to.
+static void endSample() {
+  freeObjectsSince(vm.sampleMark);
+  freeTable(&vm.globals);
 }
 
 static Value pop() {
@@ -70,14 +125,31 @@ static InterpretResult run() {
     case OP_ADD:
       BINARY_OP(INTEGER_VAL, +);
       break;
-    case OP_ADD2CLLCTN: {
-      CHECK_COLLECTION(0, "Must have a collection to add to.");
-      ObjCollection* c = AS_COLLECTION(pop());
+    case OP_ADD2CLLCTN:
+    case OP_EXTEND_CLLCTN: {
+      // The n integers are below the collection, or above it.
       uint8_t n = READ_BYTE();
-      for (int i = 0; i < n; i++) {
-        CHECK_INTEGER(0, "Can only add integers to a collection.");
-        addToCollection(c, AS_INTEGER(pop()));
+      int at = instruction == OP_ADD2CLLCTN ? 0 : n;
+      int first = at == 0 ? 1 : 0;
+      CHECK_COLLECTION(at, "Must have a collection to add to.");
+      ObjCollection* c = AS_COLLECTION(peek(at));
+      ElementWidth width = c->width;
+      for (int i = first; i < first + n; i++) {
+        CHECK_INTEGER(i, "Can only add integers to a collection.");
+        if (widthFor(AS_INTEGER(peek(i))) > width) {
+          width = widthFor(AS_INTEGER(peek(i)));
+        }
+      }
+      // A literal added to a group at a time grows by doubling.
+      int capacity = c->count + n;
+      if (capacity > c->capacity && c->capacity > 0 && capacity < 2 * c->capacity) {
+        capacity = 2 * c->capacity;
       }
+      reserveCollection(c, capacity, width);
+      for (int i = first; i < first + n; i++) {
+        appendElement(c, AS_INTEGER(peek(i)));
+      }
+      vm.stackTop -= n + 1;
       push(OBJ_VAL(c));
       break;
     }
@@ -96,8 +168,18 @@ static InterpretResult run() {
     case OP_CHOOSE: {
       CHECK_COLLECTION(0, "Can only 'choose' from a collection.");
       ObjCollection* c = AS_COLLECTION(pop());
+      if (c->count == 0) {
+        runtimeError("Can only 'choose' from a non-empty collection.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
       int index = randomi(c->count);
-      push(INTEGER_VAL(c->ints[index]));
+      if (IS_COUNTED(c)) {
+        push(INTEGER_VAL(countedElementAt(c, index)));
+      } else if (IS_RANGE(c)) {
+        push(INTEGER_VAL(c->lo + index));
+      } else {
+        push(INTEGER_VAL(elementAt(c, index)));
+      }
       break;
     }
     case OP_CONSTANT: {
@@ -105,14 +187,21 @@ static InterpretResult run() {
       push(constant);
       break;
     }
+    case OP_CONSTANT_LONG: {
+      Value constant = READ_CONSTANT_LONG();
+      push(constant);
+      break;
+    }
     case OP_COUNT: {
       CHECK_COLLECTION(0, "Operand for 'count' must be a collection.");
       ObjCollection *c = AS_COLLECTION(pop());
       push(INTEGER_VAL(c->count));
       break;
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString* name = READ_STRING();
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG: {
+      ObjString* name = instruction == OP_DEFINE_GLOBAL ? READ_STRING() : READ_STRING_LONG();
+      shareValue(peek(0));
       tableSet(&vm.globals, name, peek(0));
       pop();
       break;
@@ -126,36 +215,68 @@ static InterpretResult run() {
     case OP_DIFFERENT: {
       CHECK_COLLECTION(0, "Operand to 'different' must be a collection.");
       ObjCollection* c = AS_COLLECTION(pop());
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        int d = c->ints[i];
+      if (IS_RANGE(c)) {
+        push(OBJ_VAL(c));
+        break;
+      }
+      ObjCollection* r = ownCollection(c);
+      if (IS_COUNTED(r)) {
+        r->count = 0;
+        for (int i = 0; i < r->span; i++) {
+          r->counts[i] = r->counts[i] > 0;
+          r->count += r->counts[i];
+        }
+        push(OBJ_VAL(r));
+        break;
+      }
+      // Compacts the first occurrences to the front; member only looks at
+      // the ones kept so far.
+      int n = r->count;
+      r->count = 0;
+      for (int i = 0; i < n; i++) {
+        int d = elementAt(r, i);
         if (!member(r, d)) {
-          addToCollection(r, d);
+          storeElement(r->elements, r->width, r->count++, d);
         }
       }
       push(OBJ_VAL(r));
       break;
     }
     case OP_DIVIDE:
-      BINARY_OP(INTEGER_VAL, /);
+      DIVISION_OP(/);
       break;
     case OP_DROP: {
       CHECK_COLLECTION(0, "Operands to drop must be collections.");
       CHECK_COLLECTION(1, "Operands to drop must be collections.");
       ObjCollection* d = AS_COLLECTION(pop());
       ObjCollection* c = AS_COLLECTION(pop());
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        int item = c->ints[i];
+      ObjCollection* r = ownCollection(c);
+      if (IS_RANGE(r)) {
+        flattenCollection(r);
+      }
+      if (IS_COUNTED(r)) {
+        for (int i = 0; i < r->span; i++) {
+          if (member(d, r->lo + i)) {
+            r->count -= r->counts[i];
+            r->counts[i] = 0;
+          }
+        }
+        push(OBJ_VAL(r));
+        break;
+      }
+      int n = r->count;
+      r->count = 0;
+      for (int i = 0; i < n; i++) {
+        int item = elementAt(r, i);
         if (!member(d, item)) {
-          addToCollection(r, item);
+          storeElement(r->elements, r->width, r->count++, item);
         }
       }
       push(OBJ_VAL(r));
       break;
     }
     case OP_EQ:
-      REL_OP(==);
+      REL_OP(FILTER_EQ);
       break;
     case OP_FIRST: {
       CHECK_PAIR(0, "Operand must be a pair.");
@@ -164,10 +285,11 @@ static InterpretResult run() {
       break;
     }
     case OP_GE:
-      REL_OP(>=);
+      REL_OP(FILTER_GE);
       break;
-    case OP_GET_GLOBAL: {
-      ObjString* name = READ_STRING();
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      ObjString* name = instruction == OP_GET_GLOBAL ? READ_STRING() : READ_STRING_LONG();
       Value value;
       if (!tableGet(&vm.globals, name, &value)) {
         runtimeError("Undefined variable '%s'.", name->chars);
@@ -177,7 +299,7 @@ static InterpretResult run() {
       break;
     }
     case OP_GT:
-      REL_OP(>);
+      REL_OP(FILTER_GT);
       break;
     case OP_HCONC:
       BINARY_STRING_OP("h");
@@ -187,7 +309,8 @@ static InterpretResult run() {
       vm.ip += offset;
       break;
     }
-    case OP_JUMP_IF_EMPTY: {
+    case OP_JUMP_IF_EMPTY:
+    case OP_JUMP_IF_EMPTY_LONG: {
       bool doJump = false;
       if (IS_INTEGER(peek(0))) {
         pop(); // any integer is a non-empty collection, so not jumping
@@ -198,22 +321,42 @@ static InterpretResult run() {
         runtimeError("If expression must return a collection (or single integer).");
         return INTERPRET_RUNTIME_ERROR;
       }
-      uint16_t offset = READ_SHORT();
+      uint32_t offset = instruction == OP_JUMP_IF_EMPTY ? READ_SHORT() : READ_U32();
       if (doJump) {
         vm.ip += offset;
       }
       break;
     }
+    case OP_JUMP_LONG: {
+      uint32_t offset = READ_U32();
+      vm.ip += offset;
+      break;
+    }
     case OP_KEEP: {
       CHECK_COLLECTION(0, "Operands to drop must be collections.");
       CHECK_COLLECTION(1, "Operands to drop must be collections.");
       ObjCollection* d = AS_COLLECTION(pop());
       ObjCollection* c = AS_COLLECTION(pop());
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        int item = c->ints[i];
+      ObjCollection* r = ownCollection(c);
+      if (IS_RANGE(r)) {
+        flattenCollection(r);
+      }
+      if (IS_COUNTED(r)) {
+        for (int i = 0; i < r->span; i++) {
+          if (!member(d, r->lo + i)) {
+            r->count -= r->counts[i];
+            r->counts[i] = 0;
+          }
+        }
+        push(OBJ_VAL(r));
+        break;
+      }
+      int n = r->count;
+      r->count = 0;
+      for (int i = 0; i < n; i++) {
+        int item = elementAt(r, i);
         if (member(d, item)) {
-          addToCollection(r, item);
+          storeElement(r->elements, r->width, r->count++, item);
         }
       }
       push(OBJ_VAL(r));
@@ -224,34 +367,59 @@ static InterpretResult run() {
       CHECK_INTEGER(1, "First argument to 'largest' must be an intger.");
       ObjCollection* c = AS_COLLECTION(pop());
       int n = AS_INTEGER(pop());
-      reverseSortCollection(c);
-      int upper = (int)fmin(c->count, n);
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < upper; i++) {
-        addToCollection(r, c->ints[i]);
+      if (IS_RANGE(c)) {
+        int hi = c->lo + c->count - 1;
+        int take = (int)fmax(fmin(c->count, n), 0);
+        push(OBJ_VAL(initRangeCollection(hi - take + 1, hi)));
+        break;
+      }
+      ObjCollection* r = ownCollection(c);
+      if (IS_COUNTED(r)) {
+        int kept = 0;
+        for (int i = r->span - 1; i >= 0; i--) {
+          r->counts[i] = (int)fmin(r->counts[i], fmax(n - kept, 0));
+          kept += r->counts[i];
+        }
+        r->count = kept;
+        push(OBJ_VAL(r));
+        break;
       }
+      reverseSortCollection(r);
+      r->count = (int)fmax(fmin(r->count, n), 0);
       push(OBJ_VAL(r));
       break;
     }
     case OP_LE:
-      REL_OP(<=);
+      REL_OP(FILTER_LE);
       break;
     case OP_LEAST: {
       CHECK_COLLECTION(0, "'least' only works on collections.");
       CHECK_INTEGER(1, "First argument to 'least' must be an intger.");
       ObjCollection* c = AS_COLLECTION(pop());
       int n = AS_INTEGER(pop());
-      sortCollection(c);
-      int upper = (int)fmin(c->count, n);
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < upper; i++) {
-        addToCollection(r, c->ints[i]);
+      if (IS_RANGE(c)) {
+        int take = (int)fmax(fmin(c->count, n), 0);
+        push(OBJ_VAL(initRangeCollection(c->lo, c->lo + take - 1)));
+        break;
+      }
+      ObjCollection* r = ownCollection(c);
+      if (IS_COUNTED(r)) {
+        int kept = 0;
+        for (int i = 0; i < r->span; i++) {
+          r->counts[i] = (int)fmin(r->counts[i], fmax(n - kept, 0));
+          kept += r->counts[i];
+        }
+        r->count = kept;
+        push(OBJ_VAL(r));
+        break;
       }
+      sortCollection(r);
+      r->count = (int)fmax(fmin(r->count, n), 0);
       push(OBJ_VAL(r));
       break;
     }
     case OP_LT:
-      REL_OP(<);
+      REL_OP(FILTER_LT);
       break;
     case OP_MAX: {
       CHECK_COLLECTION(0, "Operand to 'max' must be a non-empty collection.");
@@ -260,30 +428,40 @@ static InterpretResult run() {
         runtimeError("Can only compute max of a non-empty collection.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      int max = INT32_MIN;
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] > max) {
-          max = c->ints[i];
-        }
+      if (IS_COUNTED(c)) {
+        push(INTEGER_VAL(countedElementAt(c, c->count - 1)));
+        break;
+      }
+      if (IS_RANGE(c)) {
+        push(INTEGER_VAL(c->lo + c->count - 1));
+        break;
       }
-      push(INTEGER_VAL(max));
+      push(INTEGER_VAL(maxElements(c->width, c->elements, c->count)));
       break;
     }
     case OP_MAXIMAL: {
       CHECK_COLLECTION(0, "Operand to 'maximal' must be a collection.");
       ObjCollection* c = AS_COLLECTION(pop());
-      int max = INT32_MIN;
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] > max) {
-          max = c->ints[i];
-        }
+      if (IS_COUNTED(c) && c->count > 0) {
+        int max = countedElementAt(c, c->count - 1);
+        ObjCollection* r = initCountedCollection(max, max);
+        r->counts[0] = c->counts[max - c->lo];
+        r->count = r->counts[0];
+        push(OBJ_VAL(r));
+        break;
       }
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] == max) {
-          addToCollection(r, c->ints[i]);
-        }
+      if (IS_RANGE(c)) {
+        int max = c->lo + c->count - 1;
+        push(OBJ_VAL(initRangeCollection(max, max)));
+        break;
       }
+      ObjCollection* r = ownCollection(c);
+      int occurrences;
+      int max = maximalElements(r->width, r->elements, r->count, &occurrences);
+      for (int i = 0; i < occurrences; i++) {
+        storeElement(r->elements, r->width, i, max);
+      }
+      r->count = occurrences;
       push(OBJ_VAL(r));
       break;
     }
@@ -292,12 +470,9 @@ static InterpretResult run() {
       CHECK_POSITIVE_INTEGER(1, "Expression for number of die must be a positive integer.");
       int sides = AS_INTEGER(pop());
       int ndice = AS_INTEGER(pop());
-      ObjCollection* c = initCollection();
+      ObjCollection* c = initPoolCollection(ndice, 1, sides);
       push(OBJ_VAL(c));
-      for (int i = 0; i < ndice; i++) {
-        int r = randomi(sides) + 1;
-        addToCollection(c, r);
-      }
+      rollPool(c, ndice, sides, 1);
       break;
     }
     case  OP_MEDIAN: {
@@ -308,8 +483,17 @@ static InterpretResult run() {
         return INTERPRET_RUNTIME_ERROR;
       }
       int i = (c->count)/2;
-      sortCollection(c);
-      push(INTEGER_VAL(c->ints[i]));
+      if (IS_COUNTED(c)) {
+        push(INTEGER_VAL(countedElementAt(c, i)));
+        break;
+      }
+      if (IS_RANGE(c)) {
+        push(INTEGER_VAL(c->lo + i));
+        break;
+      }
+      ObjCollection* r = ownCollection(c);
+      sortCollection(r);
+      push(INTEGER_VAL(elementAt(r, i)));
       break;
     }
     case OP_MIN: {
@@ -319,30 +503,39 @@ static InterpretResult run() {
         runtimeError("Can only compute min of a non-empty collection.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      int min = INT32_MAX;
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] < min) {
-          min = c->ints[i];
-        }
+      if (IS_COUNTED(c)) {
+        push(INTEGER_VAL(countedElementAt(c, 0)));
+        break;
       }
-      push(INTEGER_VAL(min));
+      if (IS_RANGE(c)) {
+        push(INTEGER_VAL(c->lo));
+        break;
+      }
+      push(INTEGER_VAL(minElements(c->width, c->elements, c->count)));
       break;
     }
     case OP_MINIMAL: {
       CHECK_COLLECTION(0, "Operand to 'minimal' must be a collection.");
       ObjCollection* c = AS_COLLECTION(pop());
-      int min = INT32_MAX;
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] < min) {
-          min = c->ints[i];
-        }
+      if (IS_COUNTED(c) && c->count > 0) {
+        int min = countedElementAt(c, 0);
+        ObjCollection* r = initCountedCollection(min, min);
+        r->counts[0] = c->counts[min - c->lo];
+        r->count = r->counts[0];
+        push(OBJ_VAL(r));
+        break;
       }
-      ObjCollection* r = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        if (c->ints[i] == min) {
-          addToCollection(r, c->ints[i]);
-        }
+      if (IS_RANGE(c)) {
+        push(OBJ_VAL(initRangeCollection(c->lo, c->lo)));
+        break;
+      }
+      ObjCollection* r = ownCollection(c);
+      int occurrences;
+      int min = minimalElements(r->width, r->elements, r->count, &occurrences);
+      for (int i = 0; i < occurrences; i++) {
+        storeElement(r->elements, r->width, i, min);
       }
+      r->count = occurrences;
       push(OBJ_VAL(r));
       break;
     }
@@ -351,12 +544,9 @@ static InterpretResult run() {
       CHECK_POSITIVE_INTEGER(1, "Expression for number of die must be a positive integer.");
       int sides = AS_INTEGER(pop());
       int ndice = AS_INTEGER(pop());
-      ObjCollection* c = initCollection();
+      ObjCollection* c = initPoolCollection(ndice, 0, sides);
       push(OBJ_VAL(c));
-      for (int i = 0; i < ndice; i++) {
-        int r = randomi(sides + 1);
-        addToCollection(c, r);
-      }
+      rollPool(c, ndice, sides + 1, 0);
       break;
     }
     case OP_MKCOLLECTION: {
@@ -372,7 +562,7 @@ static InterpretResult run() {
       break;
     }
     case OP_MOD:
-      BINARY_OP(INTEGER_VAL, %);
+      DIVISION_OP(%);
       break;
     case OP_MULTIPLY:
       BINARY_OP(INTEGER_VAL, *);
@@ -383,7 +573,7 @@ static InterpretResult run() {
       break;
     }
     case OP_NEQ:
-      REL_OP(!=);
+      REL_OP(FILTER_NEQ);
       break;
     case OP_NOT: {
       CHECK_COLLECTION(0, "Operand to '!' must be a collection.");
@@ -404,14 +594,15 @@ static InterpretResult run() {
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjCollection* c = AS_COLLECTION(pop());
-      ObjCollection* candidates = copyCollection(c);
+      ObjCollection* candidates = ownCollection(c);
+      flattenCollection(candidates);
       if (n >= candidates->count) {
         push(OBJ_VAL(candidates));
       } else {
-        ObjCollection* r = initCollection();
+        ObjCollection* r = initSizedCollection(n, candidates->width);
         for (int i = 0; i < n; i ++) {
           int index = randomi(candidates->count);
-          addToCollection(r, candidates->ints[index]);
+          appendElement(r, elementAt(candidates, index));
           removeAtIndex(candidates, index);
         }
         push(OBJ_VAL(r));
@@ -435,18 +626,16 @@ static InterpretResult run() {
       CHECK_INTEGER(1, "Operands to range must be integers.");
       int r = AS_INTEGER(pop());
       int l = AS_INTEGER(pop());
-      ObjCollection* c = initCollection();
-      for (int i = l; i < r; i++) {
-        addToCollection(c, i);
+      if (r > l && (int64_t)r - l > INT_MAX) {
+        runtimeError("Range is too large.");
+        return INTERPRET_RUNTIME_ERROR;
       }
+      ObjCollection* c = r > l ? initRangeCollection(l, r - 1) : initCollection();
       push(OBJ_VAL(c));
       break;
     }
-    case OP_RETURN: {
-      printValue(pop());
-      printf("\n");
-      return INTERPRET_OK;
-    }
+    case OP_RETURN:
+      return INTERPRET_OK; // runSample pops the result
     case OP_SECOND: {
       CHECK_PAIR(0, "Operand must be a pair.");
       ObjPair* p = AS_PAIR(pop());
@@ -458,10 +647,25 @@ static InterpretResult run() {
       CHECK_COLLECTION(1, "Union operands must be collections.");
       ObjCollection *d = AS_COLLECTION(pop());
       ObjCollection *c = AS_COLLECTION(pop());
-      ObjCollection *r = copyCollection(c);
+      ObjCollection *r = ownCollection(c);
+      flattenCollection(d);
+      if (IS_RANGE(r)) {
+        flattenCollection(r);
+      }
 
+      if (IS_COUNTED(r)) {
+        for (int i = 0; i < d->count; i++) {
+          int item = elementAt(d, i);
+          if (member(r, item)) {
+            r->counts[item - r->lo]--;
+            r->count--;
+          }
+        }
+        push(OBJ_VAL(r));
+        break;
+      }
       for (int i = 0; i < d->count; i++) {
-        int index = findFirstIndex(r, d->ints[i]);
+        int index = findFirstIndex(r, elementAt(d, i));
         if (index > -1) {
           removeAtIndex(r, index);
         }
@@ -487,11 +691,21 @@ static InterpretResult run() {
     case OP_SUM: {
       CHECK_COLLECTION(0, "Operand for 'sum' must be a collection.");
       ObjCollection* c = AS_COLLECTION(pop());
-      int sum = 0;
-      for (int i = 0; i < c->count; i++) {
-        sum += c->ints[i];
+      if (IS_COUNTED(c)) {
+        int sum = 0;
+        for (int i = 0; i < c->span; i++) {
+          sum += (c->lo + i) * c->counts[i];
+        }
+        push(INTEGER_VAL(sum));
+        break;
+      }
+      if (IS_RANGE(c)) {
+        // Wraps around like the element-by-element sum would.
+        int64_t n = c->count;
+        push(INTEGER_VAL((int)(uint32_t)(n * c->lo + n * (n - 1) / 2)));
+        break;
       }
-      push(INTEGER_VAL(sum));
+      push(INTEGER_VAL(sumElements(c->width, c->elements, c->count)));
       break;
     }
     case OP_UNION: {
@@ -499,12 +713,28 @@ static InterpretResult run() {
       CHECK_COLLECTION(1, "Union operands must be collections.");
       ObjCollection *d = AS_COLLECTION(pop());
       ObjCollection *c = AS_COLLECTION(pop());
-      ObjCollection *u = initCollection();
-      for (int i = 0; i < c->count; i++) {
-        addToCollection(u, c->ints[i]);
+      if (IS_COUNTED(c) && IS_COUNTED(d)) {
+        int lo = (int)fmin(c->lo, d->lo);
+        int hi = (int)fmax(c->lo + c->span, d->lo + d->span) - 1;
+        if (hi - lo + 1 <= c->count + d->count) {
+          ObjCollection* u = initCountedCollection(lo, hi);
+          for (int i = 0; i < c->span; i++) {
+            u->counts[c->lo - lo + i] += c->counts[i];
+          }
+          for (int i = 0; i < d->span; i++) {
+            u->counts[d->lo - lo + i] += d->counts[i];
+          }
+          u->count = c->count + d->count;
+          push(OBJ_VAL(u));
+          break;
+        }
       }
+      flattenCollection(c);
+      flattenCollection(d);
+      ObjCollection *u = ownCollection(c);
+      reserveCollection(u, u->count + d->count, d->width);
       for (int i = 0; i < d->count; i++) {
-        addToCollection(u, d->ints[i]);
+        appendElement(u, elementAt(d, i));
       }
       push(OBJ_VAL(u));
       break;
@@ -528,6 +758,31 @@ static InterpretResult run() {
   }
 }
 
+// Adds ndice rolls of a die numbered offset .. offset + faces - 1 to c.
+// A large counted pool gets its face counts from one multinomial draw,
+// which costs O(faces) instead of O(ndice) and has the same distribution.
+static void rollPool(ObjCollection* c, int ndice, int faces, int offset) {
+  if (IS_COUNTED(c) && vm.poolSampling == POOLS_MULTINOMIAL
+      && ndice / faces >= MULTINOMIAL_DICE_PER_FACE) {
+    multinomial(ndice, faces, c->counts);
+    c->count = ndice;
+    return;
+  }
+
+  if (IS_COUNTED(c)) {
+    for (int i = 0; i < ndice; i++) {
+      c->counts[randomi(faces)]++;
+    }
+    c->count += ndice;
+    return;
+  }
+
+  reserveCollection(c, c->count + ndice, widthForRange(offset, offset + faces - 1));
+  for (int i = 0; i < ndice; i++) {
+    appendElement(c, randomi(faces) + offset);
+  }
+}
+
 static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
@@ -535,13 +790,13 @@ static Value peek(int distance) {
 static void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm.errors, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fputs("\n", vm.errors);
 
   size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction];
-  fprintf(stderr, "[line %d] in script\n", line);
+  int line = getLine(vm.chunk, (int)instruction);
+  fprintf(vm.errors, "[line %d] in script\n", line);
   resetStack();
 }
 
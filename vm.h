@@ -1,6 +1,8 @@
 #ifndef tvm_vm_h
 #define tvm_vm_h
 
+#include <stdio.h>
+
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
@@ -8,12 +10,23 @@
 
 #define STACK_MAX 256
 
+typedef enum {
+  POOLS_MULTINOMIAL, // draw the face counts of large counted pools directly
+  POOLS_PER_DIE      // always roll every die
+} PoolSampling;
+
 typedef struct {
   Chunk* chunk;
   uint8_t *ip;
   Value stack[STACK_MAX];
   Value* stackTop;
   Table globals;
+  PoolSampling poolSampling;
+  uint64_t seed;
+  uint64_t stream; // which random stream samples are drawn from
+  bool sampled;    // whether sampleMark is set
+  Obj* sampleMark; // the newest object allocated before the last sample
+  FILE* errors;    // where runtime errors are reported
 } VM;
 
 typedef enum {
@@ -24,6 +37,10 @@ typedef enum {
 
 void freeVM(void);
 void initVM(void);
-InterpretResult interpret(Chunk* chunk);
+InterpretResult runSample(Chunk* chunk, uint64_t index, Value* result);
+void setErrors(FILE* errors);
+void setPoolSampling(PoolSampling sampling);
+void setSeed(uint64_t seed);
+void setStream(uint64_t stream);
 
 #endif